@@ -120,7 +120,9 @@ int options(int argc, char ** argv, Opts& opts) {
     // transform primitives into structs
     opts.query.img = imread(opts.query_image_file);
     if (vm.count(query_cloud) == 1) {
-        io::loadPCDFile(opts.query_cloud_file, opts.query.cloud);
+        PointCloudT::Ptr cloud(new PointCloudT());
+        io::loadPCDFile(opts.query_cloud_file, *cloud);
+        opts.query.cloud = cloud;
     }
     opts.camera = Camera(opts.camera_file, Camera::TOD_YAML);
     return 0;
@@ -140,6 +142,7 @@ int main(int argc, char **argv) {
         opts.detect_config_file,
         opts.refine_config_file 
     );
+    segmenter.setCamera(opts.camera);
 
     Result result;
     // Actual recognition 
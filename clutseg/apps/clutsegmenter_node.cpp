@@ -3,11 +3,19 @@
  * This ROS node subscribes to 
  *      1) an input point cloud
  *      2) a corresponding camera image
+ *      3) the camera info, which is read only once
  * and subsequently publishes 
  *      1) the inliers point cloud belonging to the rigid textured object. 
  *      2) the name of the recognized object
  *      3) the estimated pose (6dof) of the recognized object
  *
+ * Recognition runs on worker threads, decoupled from the subscription
+ * callback. Only the latest frame waits for a free worker; a frame that has
+ * not been picked up by the time the next one arrives is dropped, such that
+ * the published results never lag far behind the sensor. Results carry the
+ * stamp of their frame, and results that are older than the last published
+ * one are discarded, since several workers may finish out of order.
+ *
  * See also:
  *      object_recognition/tod_detecting/apps/recognition_node.cpp
  */
@@ -30,11 +38,14 @@
 #include <pcl/io/pcd_io.h>
 #include <ros/ros.h>
 #include <sensor_msgs/image_encodings.h>
+#include <sensor_msgs/CameraInfo.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <sensor_msgs/Image.h>
 #include <std_msgs/String.h>
 #include <cv_bridge/CvBridge.h>
-#include <boost/thread/mutex.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/format.hpp>
 
 //msg synchronisation
 #include <message_filters/subscriber.h>
@@ -48,6 +59,37 @@ using namespace message_filters;
 typedef message_filters::sync_policies::ApproximateTime< sensor_msgs::PointCloud2,
 							 sensor_msgs::Image> MySyncPolicy;
 
+/** \brief Converts the intrinsics given in a CameraInfo message. */
+opencv_candidate::Camera cameraFromInfo(const sensor_msgs::CameraInfo & info)
+{
+  opencv_candidate::Camera camera;
+  camera.image_size = cv::Size(info.width, info.height);
+  camera.K = cv::Mat(3, 3, CV_64F);
+  for (int i = 0; i < 9; i++)
+    {
+      camera.K.at<double>(i / 3, i % 3) = info.K[i];
+    }
+  if (info.D.empty())
+    {
+      camera.D = cv::Mat::zeros(5, 1, CV_64F);
+    }
+  else
+    {
+      camera.D = cv::Mat(info.D).clone();
+    }
+  return camera;
+}
+
+/** \brief A synchronized pair of cloud and image waiting for recognition. */
+struct Frame
+{
+  clutseg::Query query;
+  // Keeps the image message alive, which the query image may point into
+  cv_bridge::CvImageConstPtr image;
+  std::string frame_id;
+  ros::Time stamp;
+};
+
 class ClutterSegmenter
 {
 protected:
@@ -57,25 +99,46 @@ public:
   ros::Publisher inliers_publisher;
   ros::Publisher pose_publisher;
   ros::Publisher object_publisher;
+  ros::Publisher stats_publisher;
   image_transport::Publisher hud_publisher;
-  std::string input_cloud_topic, input_image_topic, modelbase, camera_info; 
+  std::string input_cloud_topic, input_image_topic, input_camera_info_topic, modelbase, camera_info; 
+  int workers;
   message_filters::Subscriber<sensor_msgs::Image> camera_sub_;
   message_filters::Subscriber<sensor_msgs::PointCloud2> cloud_sub_;
   message_filters::Synchronizer<MySyncPolicy> synchronizer_;
   message_filters::Connection sync_connection_;
-  clutseg::PointCloudT query_cloud;
-  cv::Mat query_image;
-  sensor_msgs::CvBridge bridge;
+  ros::Subscriber camera_info_sub_;
   clutseg::Clutsegmenter sgm;
+  opencv_candidate::Camera camera;
   ros::ServiceServer service;
+  ros::Timer stats_timer;
   sensor_msgs::PointCloud2 inliers_msg;
+  // Stamp of the frame whose results have been published last
+  ros::Time last_published;
+  // Guards inliers_msg and last_published, and serializes publishing
   boost::mutex lock;
+
+  // Latest-frame-wins slot between the callback and the workers, and its
+  // counters. All of them are guarded by slot_mutex.
+  boost::shared_ptr<Frame> pending;
+  boost::mutex slot_mutex;
+  boost::condition_variable slot_cond;
+  bool shutdown;
+  // Frames are dropped until the camera intrinsics are known
+  bool has_camera;
+  unsigned long received, dropped, processed, failed, stale;
+  int busy;
+  boost::thread_group worker_threads;
+
   ////////////////////////////////////////////////////////////////////////////////
-  ClutterSegmenter (ros::NodeHandle &n) : n(n),  synchronizer_( MySyncPolicy(1), cloud_sub_, camera_sub_)
+  ClutterSegmenter (ros::NodeHandle &n) : n(n),  synchronizer_( MySyncPolicy(1), cloud_sub_, camera_sub_),
+					  shutdown(false), has_camera(false), received(0), dropped(0), processed(0),
+					  failed(0), stale(0), busy(0)
   {
     inliers_publisher = n.advertise<sensor_msgs::PointCloud2>("clutseg_inliers", 1);
     pose_publisher = n.advertise<geometry_msgs::PoseStamped>("clutseg_pose", 1);
     object_publisher = n.advertise<std_msgs::String>("clutseg_object", 1);
+    stats_publisher = n.advertise<std_msgs::String>("clutseg_stats", 1);
 
     // This one is just for debugging purposes. It publishes a kind of heads-up display 
     // showing pose and inliers.
@@ -85,15 +148,35 @@ public:
     n.param("input_cloud_topic", input_cloud_topic, std::string("/kinect_head/camera/rgb/points"));
     n.param("input_image_topic", input_image_topic, std::string("/kinect_head/camera/rgb/image_color"));  
     n.param("modelbase", modelbase, std::string("./data/orb.tar"));
-    n.param("camera_info", camera_info, std::string("./data/camera.yml"));
+    n.param("input_camera_info_topic", input_camera_info_topic, std::string("/kinect_head/camera/rgb/camera_info"));
+    // Optional calibration file, which takes precedence over the topic
+    n.param("camera_info", camera_info, std::string(""));
+    n.param("workers", workers, 1);
+
+    sgm = clutseg::Clutsegmenter(modelbase, true);
+    if (camera_info.empty())
+      {
+	camera_info_sub_ = n.subscribe(input_camera_info_topic, 1, &ClutterSegmenter::cameraInfoCallback, this);
+      }
+    else
+      {
+	camera = opencv_candidate::Camera(camera_info, opencv_candidate::Camera::TOD_YAML);
+	sgm.setCamera(camera);
+	has_camera = true;
+      }
+    cv::namedWindow("hud");
+
+    for (int i = 0; i < std::max(1, workers); i++)
+      {
+	worker_threads.create_thread(boost::bind(&ClutterSegmenter::work, this));
+      }
 
     // // synchronized subscriptions 
     camera_sub_.subscribe( n, input_image_topic, 1 );
     cloud_sub_.subscribe( n, input_cloud_topic, 1 );
     sync_connection_ = synchronizer_.registerCallback( &ClutterSegmenter::callback, this );
 
-    sgm = clutseg::Clutsegmenter(modelbase, true);
-    cv::namedWindow("hud");
+    stats_timer = n.createTimer(ros::Duration(1.0), &ClutterSegmenter::statsCallback, this);
 
     service = n.advertiseService("clutseg_inliers", &ClutterSegmenter::inliersCallback, this);
     ROS_INFO("[ClutterSegmenter:] service <clutseg_inliers> is up");
@@ -101,6 +184,17 @@ public:
     ROS_INFO ("[ClutterSegmenter:] Constructor up");
   }
 
+  ~ClutterSegmenter()
+  {
+    sync_connection_.disconnect();
+    {
+      boost::mutex::scoped_lock slot(slot_mutex);
+      shutdown = true;
+    }
+    slot_cond.notify_all();
+    worker_threads.join_all();
+  }
+
   bool inliersCallback(clutseg::ClutsegObject::Request  &req,
 		       clutseg::ClutsegObject::Response &res )
   {
@@ -110,35 +204,155 @@ public:
     return true;
   }
 
+  ////////////////////////////////////////////////////////////////////////////////
+  void cameraInfoCallback(const sensor_msgs::CameraInfoConstPtr & info)
+  {
+    // Intrinsics do not change while the node is running, so only the
+    // first message is applied. Workers only read the camera for frames
+    // enqueued afterwards. Messages that have been queued before the
+    // subscription is shut down are ignored, since workers may already be
+    // recognizing by then.
+    {
+      boost::mutex::scoped_lock slot(slot_mutex);
+      if (has_camera)
+	{
+	  return;
+	}
+      camera = cameraFromInfo(*info);
+      sgm.setCamera(camera);
+      has_camera = true;
+    }
+    camera_info_sub_.shutdown();
+    ROS_INFO("[ClutterSegmenter:] received camera info");
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  void statsCallback(const ros::TimerEvent &)
+  {
+    std_msgs::String stats_msg;
+    {
+      boost::mutex::scoped_lock slot(slot_mutex);
+      stats_msg.data = str(boost::format("received=%d dropped=%d processed=%d failed=%d stale=%d queue_depth=%d busy=%d")
+			   % received % dropped % processed % failed % stale % (pending ? 1 : 0) % busy);
+    }
+    stats_publisher.publish(stats_msg);
+  }
+
   ////////////////////////////////////////////////////////////////////////////////
   void callback (const sensor_msgs::PointCloud2ConstPtr& pc, const sensor_msgs::ImageConstPtr& im)
   {
+    {
+      boost::mutex::scoped_lock slot(slot_mutex);
+      if (!has_camera)
+	{
+	  received++;
+	  dropped++;
+	  return;
+	}
+    }
+
     //1. Reading input data
-    // get image
-    query_image = bridge.imgMsgToCv(im, "bgr8");
-    // imshow("hud", query_image);
-    // cv::waitKey(-1);
-
-    // get cloud
-    pcl::fromROSMsg (*pc, query_cloud);
-    
-    //TODO: check how to convert from CameraInfo Msg to opencv_candidate::Camera
-    // it shall work for Julius since the data is from the same sensor
-    opencv_candidate::Camera camera = opencv_candidate::Camera(camera_info, opencv_candidate::Camera::TOD_YAML);
+    boost::shared_ptr<Frame> frame(new Frame());
+    frame->frame_id = pc->header.frame_id;
+    frame->stamp = pc->header.stamp;
+    // get image, shared with the message if it is already encoded as bgr8
+    frame->image = cv_bridge::toCvShare(im, "bgr8");
+
+    // get cloud, converted once into a fresh buffer that is shared by the
+    // query instead of being copied again
+    clutseg::PointCloudT::Ptr query_cloud(new clutseg::PointCloudT());
+    pcl::fromROSMsg (*pc, *query_cloud);
+    frame->query = clutseg::Query(frame->image->image, query_cloud);
+
+    //2. Hand over to the workers, replacing a frame that is still waiting
+    {
+      boost::mutex::scoped_lock slot(slot_mutex);
+      received++;
+      if (pending)
+	{
+	  dropped++;
+	}
+      pending = frame;
+    }
+    slot_cond.notify_one();
+  }
 
+  ////////////////////////////////////////////////////////////////////////////////
+  void work()
+  {
+    while (true)
+      {
+	boost::shared_ptr<Frame> frame;
+	{
+	  boost::mutex::scoped_lock slot(slot_mutex);
+	  while (!pending && !shutdown)
+	    {
+	      slot_cond.wait(slot);
+	    }
+	  if (shutdown)
+	    {
+	      return;
+	    }
+	  frame.swap(pending);
+	  busy++;
+	}
+	// A frame that cannot be recognized must not take down the worker
+	bool ok = false;
+	bool published = false;
+	try
+	  {
+	    published = process(*frame);
+	    ok = true;
+	  }
+	catch (const std::exception & e)
+	  {
+	    ROS_ERROR("[ClutterSegmenter:] recognition failed: %s", e.what());
+	  }
+	catch (...)
+	  {
+	    ROS_ERROR("[ClutterSegmenter:] recognition failed: unknown exception");
+	  }
+	{
+	  boost::mutex::scoped_lock slot(slot_mutex);
+	  busy--;
+	  if (!ok)
+	    {
+	      failed++;
+	    }
+	  else
+	    {
+	      processed++;
+	      if (!published)
+		{
+		  stale++;
+		}
+	    }
+	}
+      }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Returns false if the results have been discarded because the results of
+  // a later frame have been published already.
+  bool process (const Frame & frame)
+  {
     //2. Recognizing
-    clutseg::Query query(query_image, query_cloud);
     clutseg::Result result;
-    sgm.recognize(query, result);
+    sgm.recognize(frame.query, result);
 
     // 3. Publish to topics
+    boost::mutex::scoped_lock mutex(lock);
+    if (frame.stamp < last_published)
+      {
+	return false;
+      }
+    last_published = frame.stamp;
     if (result.guess_made) 
       { 
 	// 3.1. Publish inlier cloud
-	clutseg::PointCloudT inliers = result.refine_choice.inlierCloud;
-	pcl::toROSMsg (inliers, inliers_msg);
-	inliers_msg.header.frame_id = pc->header.frame_id;
-	inliers_msg.header.stamp = ros::Time::now();
+	pcl::toROSMsg (result.refine_choice.inlierCloud, inliers_msg);
+	inliers_msg.header.frame_id = frame.frame_id;
+	inliers_msg.header.stamp = frame.stamp;
 	inliers_publisher.publish(inliers_msg);
 
 	//3.2. Publish name of the recognized object
@@ -157,7 +371,8 @@ public:
 	Eigen::Matrix3f rotation_matrix;
 	cv::cv2eigen(rmat, rotation_matrix);
 	Eigen::Quaternion<float> quaternion(rotation_matrix);
-	pose_msg.header.frame_id = pc->header.frame_id;
+	pose_msg.header.frame_id = frame.frame_id;
+	pose_msg.header.stamp = frame.stamp;
 	pose_msg.pose.orientation.x = quaternion.x();
 	pose_msg.pose.orientation.y = quaternion.y();
 	pose_msg.pose.orientation.z = quaternion.z();
@@ -167,18 +382,21 @@ public:
 
     {
       // Just for debugging
-      cv::Mat hud = query_image.clone();
+      cv::Mat hud = frame.query.img.clone();
       if (result.guess_made) 
 	{
 	  clutseg::drawGuess(hud, result.refine_choice, camera, opencv_candidate::PoseRT());
 	}
       cv_bridge::CvImage cv_hud;
+      cv_hud.header.frame_id = frame.frame_id;
+      cv_hud.header.stamp = frame.stamp;
       cv_hud.encoding = sensor_msgs::image_encodings::BGR8;
       cv_hud.image = hud;
       // cv::imshow("hud", cv_hud.image);
       // cv::waitKey(-1);
       hud_publisher.publish(cv_hud.toImageMsg());
     } 
+    return true;
   }
 };
 
@@ -666,9 +666,12 @@ int main(int argc, char **argv) {
     sqlite3* db;
     cout << "Opening database ..." << endl;
     db_open(db, db_path);
+    upgradeSchema(db);
 
     cout << "Inserting experiment setups ..." << endl;
     insert_experiments(db);
+    notifyExperimentsEnqueued(db);
+    db_close(db);
 
     return 0;
 }
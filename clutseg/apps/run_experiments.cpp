@@ -7,6 +7,7 @@
 
 #include "clutseg/check.h"
 #include "clutseg/db.h"
+#include "clutseg/paramsel.h"
 #include "clutseg/runner.h"
 #include "clutseg/storage.h"
 
@@ -42,8 +43,9 @@ int main(int argc, char **argv) {
     // ros::init(argc, argv, "param_selection");
     // ros::NodeHandle n;
 
-    if (argc != 4 && argc != 5) {
-        cerr << "Usage: run_experiments <database> <train_cache> <result_dir>" << endl;
+    if (argc < 4 || argc > 6) {
+        cerr << "Usage: run_experiments <database> <train_cache> <result_dir> [<workers> [<threads>]]" << endl;
+        cerr << "Consider running with lowered priority, e.g. nice -n 19 ionice -c 3 run_experiments ..." << endl;
         return -1;
     }
     bfs::path db_path = argv[1];
@@ -57,6 +59,7 @@ int main(int argc, char **argv) {
     sqlite3* db;
     cout << "Opening database ..." << endl;
     db_open(db, db_path);
+    upgradeSchema(db);
  
     term = false;
 
@@ -71,6 +74,12 @@ int main(int argc, char **argv) {
     ResultStorage storage(result_dir);
     cout << "Running experiments ..." << endl;
     runner = ExperimentRunner(db, cache, storage);
+    if (argc >= 5) {
+        runner.setWorkers(atoi(argv[4]));
+    }
+    if (argc >= 6) {
+        runner.setThreads(atoi(argv[5]));
+    }
 
     runner.run();
     db_close(db);
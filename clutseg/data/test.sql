@@ -33,11 +33,26 @@ insert into response (
     avg_refine_inliers,
     avg_refine_choice_matches,
     avg_refine_choice_inliers,
+    avg_extract_wall,
+    p95_extract_wall,
+    avg_extract_cpu,
+    avg_detect_wall,
+    p95_detect_wall,
+    avg_detect_cpu,
+    avg_map_wall,
+    p95_map_wall,
+    avg_map_cpu,
+    avg_rank_wall,
+    p95_rank_wall,
+    avg_rank_cpu,
+    avg_refine_wall,
+    p95_refine_wall,
+    avg_refine_cpu,
     train_runtime,
     test_runtime
     ) values
-    (0.78, 36, 63, 0.25, 0.75, 1.0, 21, 0.34, 0.08, 0.12, 0.02, 0.56, 0.15, 0.53, 0.03, 0.63, 0.05, 0.15, 913.0, 55, 652.3, 9.2, 211.9, 13.3, 35, 5, 10, 40, 33, 802.1, 29.8, 802.1, 39.8, 320.5, 214.8);
-insert into pms_clutseg (accept_threshold, ranking) values (15, "InliersRanking");
+    (0.78, 36, 63, 0.25, 0.75, 1.0, 21, 0.34, 0.08, 0.12, 0.02, 0.56, 0.15, 0.53, 0.03, 0.63, 0.05, 0.15, 913.0, 55, 652.3, 9.2, 211.9, 13.3, 35, 5, 10, 40, 33, 802.1, 29.8, 802.1, 39.8, 0.021, 0.034, 0.020, 0.152, 0.217, 0.149, 0.004, 0.006, 0.004, 0.0001, 0.0002, 0.0001, 0.061, 0.092, 0.058, 320.5, 214.8);
+insert into pms_clutseg (accept_threshold, ranking, min_inliers, min_depth_ratio) values (15, "InliersRanking", 3, 0.25);
 insert into pms_match (matcher_type, knn, do_ratio_test, ratio_threshold) values ("LSH-BINARY", 3, 1, 0.8);
 insert into pms_match (matcher_type, knn, do_ratio_test, ratio_threshold) values ("LSH-BINARY", 3, 0, null);
 insert into pms_guess (ransac_iterations_count, min_inliers_count, max_projection_error) values (100, 5, 12);
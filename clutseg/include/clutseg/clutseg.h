@@ -8,17 +8,26 @@
 #include "clutseg/common.h"
 #include "clutseg/paramsel.h"
 #include "clutseg/options.h"
+#include "clutseg/pool.h"
 #include "clutseg/query.h"
 #include "clutseg/ranking.h"
 #include "clutseg/result.h"
+#include "clutseg/timing.h"
 	
 #include "clutseg/gcc_diagnostic_disable.h"
+    #include <boost/shared_ptr.hpp>
+    #include <boost/thread/condition_variable.hpp>
+    #include <boost/thread/mutex.hpp>
     #include <cv.h>
     #include <limits>
+    #include <map>
+    #include <opencv_candidate/Camera.h>
     #include <pcl/point_types.h>
     #include <set>
     #include <tod/detecting/GuessGenerator.h>
+    #include <tod/detecting/Matcher.h>
     #include <tod/detecting/Recognizer.h>
+    #include <tod/training/feature_extraction.h>
     #include <vector>
 #include "clutseg/gcc_diagnostic_enable.h"
 
@@ -40,7 +49,8 @@ namespace clutseg {
             acc_refine_guesses(0),
             acc_refine_choice_matches(0),
             acc_refine_choice_inliers(0),
-            choices(0) {}
+            choices(0),
+            rejected_choices(0) {}
 
         long queries;
         long acc_keypoints;
@@ -55,6 +65,31 @@ namespace clutseg {
         long acc_refine_choice_matches;
         long acc_refine_choice_inliers;
         long choices;
+        /** Number of detect choices rejected before refinement, see
+         * Clutsegmenter::isPlausible */
+        long rejected_choices;
+
+        /** Latency of feature extraction on the query image */
+        LatencyStats extract_latency;
+        /** Latency of the detection stage, excluding feature extraction.
+         * Matching and guess generation both happen inside
+         * tod::KinectRecognizer::match and cannot be timed separately. */
+        LatencyStats detect_latency;
+        /** Latency of mapping the inliers of the detect choices to the query
+         * cloud */
+        LatencyStats map_latency;
+        /** Latency of ranking the detect choices */
+        LatencyStats rank_latency;
+        /** Latency of each single refinement attempt */
+        LatencyStats refine_latency;
+        /** Latency of Clutsegmenter::recognize as a whole. The processor
+         * time is the one of the calling thread, plus the one of the
+         * refinement threads, see Clutsegmenter::setRefineThreads. Unlike
+         * clock(), it does not include other threads of the process. */
+        LatencyStats recognize_latency;
+
+        /** \brief Adds up the statistics of another accumulator object. */
+        ClutsegmenterStats & operator+=(const ClutsegmenterStats & rhs);
 
         /**
          * \brief Computes average statistics, and stores them into a response
@@ -118,6 +153,12 @@ namespace clutseg {
 
             void setAcceptThreshold(int accept_threshold);
 
+            /** \brief Sets the thresholds of the rejection gate, see
+             * ClutsegParams::min_inliers, ClutsegParams::min_depth_ratio and
+             * ClutsegParams::max_extent. All of them default to zero, which
+             * disables the gate. */
+            void setRejectionGate(int min_inliers, float min_depth_ratio, float max_extent);
+
             /** \brief Returns the guess ranking used for both the detection stage and the refinement stage. */
             cv::Ptr<GuessRanking> getRanking() const;
 
@@ -134,6 +175,96 @@ namespace clutseg {
              */
             bool isDoRefine() const;
 
+            /** \brief See Clutsegmenter::getRefineThreads. */
+            void setRefineThreads(int refine_threads);
+
+            /** \brief Returns the number of detect choices that are refined
+             * concurrently.
+             *
+             * If larger than one, the highest-ranked detect choices are
+             * refined on as many threads. The result is the same as if the
+             * choices were refined one after another, i.e. the
+             * highest-ranked accepted choice. Refinement of lower-ranked
+             * choices is cancelled once a higher-ranked choice has been
+             * accepted. Defaults to one.
+             *
+             * The querying thread refines as well, together with the threads
+             * of a pool that is shared by all concurrent queries, e.g. in
+             * recognizeBatch, and by copies of this segmenter. Hence the
+             * number of threads does not multiply with the number of
+             * concurrent queries.
+             */
+            int getRefineThreads() const;
+
+            /** \brief See Clutsegmenter::getMatcherPoolCapacity. Also applies
+             * to the matchers built already, which are shared with copies of
+             * this segmenter. */
+            void setMatcherPoolCapacity(int capacity);
+
+            /** \brief Returns how many matchers are kept per index, i.e. how
+             * many queries can match against the same index concurrently.
+             *
+             * tod::Matcher keeps the matches of its last query next to its
+             * index, hence every concurrent query needs a matcher, and index,
+             * of its own. Each of them takes as much memory as the
+             * descriptors of the modelbase, or of a template in the
+             * refinement stage. Further queries wait for a matcher to become
+             * available. Raise it only if memory allows for that many copies
+             * of the modelbase index. Defaults to two.
+             */
+            int getMatcherPoolCapacity() const;
+
+            /** \brief See Clutsegmenter::getMapNeighbourhood. */
+            void setMapNeighbourhood(int map_neighbourhood);
+
+            /** \brief Returns the size of the window that is searched for
+             * the closest valid depth if a keypoint has none, when mapping
+             * inliers to the query cloud. See mapToCloud, which rounds an
+             * even size up to the next odd one. Defaults to one, i.e. only
+             * the exact pixel is looked up.
+             */
+            int getMapNeighbourhood() const;
+
+            /** \brief See Clutsegmenter::getMaxDetectChoices. */
+            void setMaxDetectChoices(int max_detect_choices);
+
+            /** \brief Returns how many of the highest-ranked detect choices
+             * are kept and considered for refinement.
+             *
+             * Selecting only the top detect choices is cheaper than ranking
+             * all of them, and lower-ranked choices are rarely accepted
+             * anyway. Zero, the default, keeps all detect choices. */
+            int getMaxDetectChoices() const;
+
+            /** \brief See Clutsegmenter::isMultiObject. */
+            void setMultiObject(bool multi_object);
+
+            /** \brief If true, recognize returns an accepted guess for every
+             * template found on the scene, rather than only the
+             * highest-ranked one.
+             *
+             * For each template, the highest-ranked detect choice that passes
+             * the acceptance threshold is accepted. All of them share one
+             * feature extraction and one detection pass. See
+             * Result::refine_choices. Defaults to false.
+             */
+            bool isMultiObject() const;
+
+            /** \brief Returns the intrinsic camera parameters of the query
+             * images.
+             *
+             * They are read once on construction from camera.yml in the
+             * modelbase directory. If there is no such file, they must be set
+             * by Clutsegmenter::setCamera, otherwise recognition throws a
+             * runtime_error.
+             */
+            const opencv_candidate::Camera & getCamera() const;
+
+            /** \brief See Clutsegmenter::getCamera. A LinearRanking is
+             * replaced by one that uses the camera for its reprojection
+             * error. */
+            void setCamera(const opencv_candidate::Camera & camera);
+
             /** \brief Returns a set of template objects this segmenter knows,
              * such as assam_tea, haltbare_milch, icedtea, ... . */
             std::set<std::string> getTemplateNames() const;
@@ -141,9 +272,21 @@ namespace clutseg {
             /**
              * \brief Configures the parameter values.
              *
-             * Convenient if the parameter set is read from a database.
+             * Convenient if the parameter set is read from a database. Only
+             * state that depends on changed parameters is rebuilt, e.g. the
+             * matcher indices are kept unless the matcher parameters change.
              */
             void reconfigure(const Paramset & params);
+
+            /**
+             * \brief Builds the feature extractors and the matcher indices
+             * for the current parameters, which are otherwise built on first
+             * use.
+             *
+             * Copies of this segmenter made afterwards share them with each
+             * other, as long as their parameters do not change.
+             */
+            void prepare();
        
             /**
              * \brief Resets the accumulator object used for collecting statistics.
@@ -167,21 +310,104 @@ namespace clutseg {
              * object.  The detection stage yields a set of initial guesses.
              * The highest-ranked initial guess is improved in the refinement
              * stage.
+             *
+             * Statistics are added to the accumulator object returned by
+             * Clutsegmenter::getStats.
              */
             void recognize(const Query & query, Result & result);
 
+            /**
+             * \brief Finds an object in the scene, and adds the statistics of
+             * this query to the given accumulator object.
+             *
+             * Both overloads may be called concurrently from several threads
+             * on the same segmenter, which shares the modelbase and the
+             * matcher indices between the threads. This overload does not
+             * touch any shared statistics. Parameters, ranking and camera
+             * must not be changed while queries are in flight.
+             */
+            void recognize(const Query & query, Result & result, ClutsegmenterStats & stats);
+
+            /**
+             * \brief Finds an object in each of a batch of scenes.
+             *
+             * The queries are distributed over the given number of threads,
+             * or over as many threads as there are cores if threads <= 0.
+             * The i-th result belongs to the i-th query, and the statistics
+             * add up to the same as if the queries were recognized one after
+             * another.
+             */
+            void recognizeBatch(const std::vector<Query> & queries,
+                                std::vector<Result> & results,
+                                int threads = 0);
+
         private:
 
             /** \brief Detection stage. */
             bool detect(tod::Features2d & queryF2d,
                         std::vector<tod::Guess> & detectChoices,
-                        std::vector<std::pair<int, int> > & matches);
+                        std::vector<std::pair<int, int> > & matches,
+                        ClutsegmenterStats & stats);
 
-            /** \brief Refinement stage. */
+            /** \brief Refinement stage. Stores the best refined guess of
+             * the detect choice's template in refineChoice, if any. */
             bool refine(const tod::Features2d & queryF2d,
                         const PointCloudT & queryCloud,
+                        const tod::Guess & detectChoice,
+                        tod::Guess & refineChoice,
+                        std::vector<std::pair<int, int> > & matches,
+                        ClutsegmenterStats & stats);
+
+            /** \brief Cheap test whether a detect choice can possibly be
+             * accepted. Rejects choices with too few inliers, too few
+             * inliers with valid depth, or inliers spread over an
+             * implausibly large bounding box, before spending time on
+             * refinement. Maps the inliers of the detect choice to its
+             * inlierCloud if the gate needs them and they have not been
+             * mapped yet. */
+            bool isPlausible(const tod::Features2d & queryF2d,
+                        const PointCloudT & queryCloud,
+                        tod::Guess & detectChoice) const;
+
+            /** \brief Refines a detect choice, if refinement is enabled, and
+             * returns whether the outcome passes the acceptance threshold.
+             * refineChoice is only guaranteed to hold the outcome if it
+             * passes. */
+            bool tryChoice(const tod::Features2d & queryF2d,
+                        const PointCloudT & queryCloud,
+                        tod::Guess & detectChoice,
+                        tod::Guess & refineChoice,
+                        std::vector<std::pair<int, int> > & matches,
+                        ClutsegmenterStats & stats);
+
+            /** \brief Marks the i-th detect choice, and refineChoice as its
+             * outcome, as accepted. refineChoice is moved to the back of
+             * Result::refine_choices. */
+            void acceptChoice(Result & result, size_t i,
                         tod::Guess & refineChoice,
-                        std::vector<std::pair<int, int> > & matches);
+                        const std::vector<std::pair<int, int> > & ds,
+                        const std::vector<std::pair<int, int> > & ls,
+                        ClutsegmenterStats & stats);
+
+            struct RefineJob;
+
+            /** \brief Refines the ranked detect choices in result on
+             * Clutsegmenter::getRefineThreads threads. */
+            void refineParallel(const tod::Features2d & queryF2d,
+                        const PointCloudT & queryCloud,
+                        const std::vector<std::pair<int, int> > & ds,
+                        Result & result,
+                        ClutsegmenterStats & stats);
+
+            void refineWorker(RefineJob & job);
+
+            /** \brief Runs refineWorker on a thread of refine_pool_, unless
+             * the job is closed already. */
+            static void refineTask(Clutsegmenter * sgm, const boost::shared_ptr<RefineJob> & job);
+
+            struct BatchJob;
+
+            void batchWorker(BatchJob & job);
 
             /** \brief Load parameters from file. */
             void loadParams(const std::string & config,
@@ -190,16 +416,117 @@ namespace clutseg {
             /** \brief Load modelbase. */
             void loadBase();
 
+            void loadCamera();
+
+            /** \brief Hands the camera to the ranking if it needs it, see
+             * LinearRanking. */
+            void bindCamera();
+
+        protected:
+
+            // The lazily built state is accessible to subclasses, such that
+            // tests can check which of it is reused between queries.
+
+            /** \brief Matchers keep the matches of the last query, hence
+             * every concurrent query needs a matcher of its own, see
+             * Clutsegmenter::getMatcherPoolCapacity. */
+            typedef Pool<tod::Matcher> MatcherPool;
+
+            /** \brief Feature extractors keep buffers such as image pyramids
+             * between calls, and are not safe to share between threads
+             * either. */
+            typedef Pool<tod::FeatureExtractor> ExtractorPool;
+
+            /** \brief Returns the feature extractors for query images.
+             *
+             * Extractors are reused by subsequent queries, one per concurrent
+             * query, and only recreated if the feature extraction parameters
+             * have changed. */
+            cv::Ptr<ExtractorPool> getExtractors();
+
+            /** \brief Returns the matchers used in the detection stage.
+             *
+             * The index over all descriptors in the modelbase is expensive to
+             * build. It is built on first use and only rebuilt if the matcher
+             * parameters in the detection stage have changed since. Callers
+             * that need the index meanwhile wait for it, but cache_mutex_ is
+             * not held while building. */
+            cv::Ptr<MatcherPool> getDetectMatchers();
+
+            /** \brief A single template, together with the matchers used for
+             * locating it in the refinement stage. */
+            struct RefineModel {
+                cv::Ptr<tod::TrainingBase> base;
+                cv::Ptr<MatcherPool> matchers;
+            };
+
+            /** \brief Returns the refinement model for a template.
+             *
+             * The models are created lazily, once per template, and reused by
+             * all subsequent queries. They are rebuilt if the matcher
+             * parameters in the refinement stage have changed. */
+            RefineModel getRefineModel(const std::string & name);
+
+        private:
+
             ClutsegmenterStats stats_;
+            /** \brief Guards stats_. */
+            cv::Ptr<boost::mutex> stats_mutex_;
+            /** \brief Guards the lazily built matchers. Indices are built
+             * without holding it, see building_detect_matchers_ and
+             * building_refine_models_. */
+            cv::Ptr<boost::mutex> cache_mutex_;
+            /** \brief Signalled whenever a matcher index has been built. */
+            cv::Ptr<boost::condition_variable> cache_built_;
             std::string baseDirectory_;
             tod::TODParameters detect_params_; 
             tod::TODParameters refine_params_; 
-            tod::TrainingBase base_;
+            /** \brief The modelbase. Shared between copies of this segmenter
+             * such that it lives as long as the matchers built from it. */
+            cv::Ptr<tod::TrainingBase> base_;
+            cv::Ptr<ExtractorPool> extractors_;
+            /** \brief The parameters extractors_ create extractors with. */
+            tod::FeatureExtractionParams extractor_params_;
+            cv::Ptr<MatcherPool> detect_matchers_;
+            /** \brief The parameters detect_matchers_ have been built with. */
+            tod::MatcherParameters detect_matcher_params_;
+            std::map<std::string, RefineModel> refine_models_;
+            /** \brief The parameters the models in refine_models_ have been
+             * built with. */
+            tod::MatcherParameters refine_matcher_params_;
             std::vector<cv::Ptr<tod::TexturedObject> > objects_;
+            opencv_candidate::Camera camera_;
             cv::Ptr<GuessRanking> ranking_;
+            /** \brief Name of ranking_ if created by reconfigure, empty
+             * otherwise. */
+            std::string ranking_name_;
             float accept_threshold_;
+            int min_inliers_;
+            float min_depth_ratio_;
+            float max_extent_;
             bool do_refine_;
+            int refine_threads_;
+            /** \brief Helps refining in refineParallel, with one thread less
+             * than refine_threads_. Shared between copies of this segmenter
+             * and by concurrent queries. */
+            cv::Ptr<ThreadPool> refine_pool_;
+            /** \brief Guarded by cache_mutex_, since pools are created with
+             * it while other queries are in flight. */
+            int matcher_pool_capacity_;
+            int map_neighbourhood_;
+            int max_detect_choices_;
+            bool multi_object_;
             bool initialized_;
+            /** \brief Whether camera_ has been loaded or set, see
+             * Clutsegmenter::getCamera. */
+            bool has_camera_;
+            /** \brief Whether a thread is building detect_matchers_.
+             * Other threads wait for it rather than building another
+             * index. */
+            bool building_detect_matchers_;
+            /** \brief Templates whose refinement model a thread is
+             * building. */
+            std::set<std::string> building_refine_models_;
 
     };
 
@@ -22,6 +22,8 @@ namespace clutseg {
     /** \brief Opens a SQLite database.
      *
      * Delegates to sqlite3_open. Throws ios_base::failure if an error occurs.
+     * Statements wait for up to a minute if the database is locked by
+     * another process, rather than failing right away.
      */
     void db_open(sqlite3* & db, const boost::filesystem::path & filename);
     
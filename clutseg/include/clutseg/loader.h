@@ -0,0 +1,182 @@
+/*
+ * Author: Julius Adorf
+ */
+
+#ifndef _LOADER_H_
+#define _LOADER_H_
+
+#include "clutseg/ground.h"
+#include "clutseg/query.h"
+
+#include "clutseg/gcc_diagnostic_disable.h"
+    #include <boost/filesystem.hpp>
+    #include <boost/shared_ptr.hpp>
+    #include <boost/thread.hpp>
+    #include <cv.h>
+    #include <deque>
+    #include <map>
+    #include <opencv_candidate/Camera.h>
+    #include <string>
+    #include <vector>
+#include "clutseg/gcc_diagnostic_enable.h"
+
+namespace clutseg {
+
+    /** \brief Loads the test scenes of a test set in the background.
+     *
+     * Images and clouds are read and decoded on a thread of their own, ahead
+     * of the scene that is currently being recognized. Scenes that have been
+     * loaded but not yet taken are limited to a memory budget, though at
+     * least one scene is always loaded ahead.
+     */
+    class SceneLoader {
+
+        public:
+
+            /** \brief Starts loading the given images from dir, together with
+             * their clouds, see cloudPath. */
+            SceneLoader(const boost::filesystem::path & dir,
+                        const std::vector<std::string> & img_names,
+                        size_t budget_bytes);
+
+            ~SceneLoader();
+
+            /** \brief Takes the next scene, in the order of the image names
+             * passed on construction, and waits for it if it has not been
+             * loaded yet. Returns false if all scenes have been taken.
+             * Throws runtime_error if the image or its cloud cannot be
+             * read, on this and any further call. */
+            bool next(std::string & img_name, Query & query);
+
+        private:
+
+            SceneLoader(const SceneLoader &);
+            SceneLoader & operator=(const SceneLoader &);
+
+            struct Scene {
+                std::string img_name;
+                Query query;
+                size_t bytes;
+                std::string error;
+            };
+
+            void load();
+
+            boost::filesystem::path dir_;
+            std::vector<std::string> img_names_;
+            size_t budget_bytes_;
+            /** \brief Scenes that have been loaded but not taken yet. */
+            std::deque<Scene> ready_;
+            /** \brief Memory taken by the scenes in ready_. */
+            size_t ready_bytes_;
+            size_t taken_;
+            bool stop_;
+            boost::mutex mutex_;
+            boost::condition_variable cond_;
+            boost::thread thread_;
+
+    };
+
+    /** \brief A test set, with everything needed to run an experiment on
+     * it. */
+    struct TestSet {
+
+        boost::filesystem::path dir;
+        GroundTruth ground_truth;
+        opencv_candidate::Camera camera;
+        /** \brief Decoded test scenes by image name. Empty unless the test
+         * set has been cached, see TestSetCache. */
+        std::map<std::string, Query> scenes;
+
+    };
+
+    /** \brief Keeps test sets in memory across experiments.
+     *
+     * The ground truth and the camera of a test set are read only once. The
+     * test scenes are decoded in the background on first request, and kept
+     * as long as the whole test set fits into the memory budget of the
+     * cache. The test sets that have been requested least recently are
+     * evicted to make room for another one. Until the scenes of a test set
+     * are ready, or if they do not fit at all, they have to be loaded for
+     * every experiment, see SceneLoader. Queries are not modified during
+     * recognition, so the scenes can be shared by experiments that run
+     * concurrently.
+     */
+    class TestSetCache {
+
+        public:
+
+            /** \brief Creates a cache whose decoded scenes take at most
+             * budget_bytes. While a test set is decoded, its scenes take
+             * memory on top of that. */
+            TestSetCache(size_t budget_bytes);
+
+            /** \brief Stops decoding and waits for the decoding threads. */
+            ~TestSetCache();
+
+            /** \brief Returns the test set in the given directory, and reads
+             * its ground truth and camera on first request. Does not wait
+             * for the scenes, which are empty until they have been decoded.
+             * The test set stays valid after it has been evicted. May be
+             * called concurrently. Throws runtime_error if the test set
+             * cannot be read. */
+            boost::shared_ptr<const TestSet> get(const boost::filesystem::path & dir);
+
+            /** \brief Blocks until no test set is being decoded. */
+            void waitUntilDecoded();
+
+            size_t getBudgetBytes() const;
+
+        private:
+
+            TestSetCache(const TestSetCache &);
+            TestSetCache & operator=(const TestSetCache &);
+
+            enum State {
+                NOT_CACHED,
+                DECODING,
+                CACHED,
+                /** \brief The test set does not fit into the budget or
+                 * cannot be decoded, and is not tried again. */
+                UNCACHEABLE
+            };
+
+            struct Entry {
+                Entry() : state(NOT_CACHED), bytes(0), last_used(0) {}
+                /** \brief Guards reading the ground truth and the camera. */
+                boost::mutex mutex;
+                boost::shared_ptr<const TestSet> test_set;
+                State state;
+                /** \brief Memory taken by the scenes if cached. */
+                size_t bytes;
+                /** \brief Value of TestSetCache::clock_ when the test set
+                 * has been requested last. */
+                unsigned long last_used;
+            };
+
+            void decode(cv::Ptr<Entry> entry);
+
+            /** \brief Evicts the least recently used test sets other than
+             * keep until bytes more fit into the budget. Returns false if
+             * they do not fit even though all others have been evicted. */
+            bool makeRoom(size_t bytes, const Entry * keep);
+
+            const size_t budget_bytes_;
+            size_t used_bytes_;
+            unsigned long clock_;
+            /** \brief Number of test sets being decoded. */
+            int decoding_;
+            bool stop_;
+            std::map<std::string, cv::Ptr<Entry> > entries_;
+            /** \brief Guards all members but budget_bytes_ and
+             * decoders_, and the entries except for reading. */
+            boost::mutex mutex_;
+            /** \brief Signalled whenever a test set has been decoded. */
+            boost::condition_variable decoded_;
+            boost::thread_group decoders_;
+
+    };
+
+}
+
+#endif
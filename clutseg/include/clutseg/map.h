@@ -18,16 +18,27 @@
 
 namespace clutseg {
 
-    /** \brief Maps 2D points in a scene to the corresponding 3D points. */
+    /** \brief Maps 2D points in a scene to the corresponding 3D points.
+     *
+     * scene3d must be an organized cloud. Points outside of the cloud are
+     * mapped to NaN. If neighbourhood is larger than one and the exact
+     * pixel has no depth, the closest valid point in a neighbourhood x
+     * neighbourhood window around it is taken instead, such that more
+     * keypoints close to depth discontinuities end up with a 3D point. The
+     * window is centred on the pixel, so an even neighbourhood is rounded
+     * up to the next odd one, e.g. 2 searches a 3x3 window.
+     */
     void mapToCloud(PointCloudT & keypoints3d,
-                    const std::vector<cv::Point> keypoints2d,
+                    const std::vector<cv::Point> & keypoints2d,
                     const cv::Mat & scene2d,
-                    const PointCloudT & scene3d);
+                    const PointCloudT & scene3d,
+                    int neighbourhood = 1);
 
     /** \brief Maps the inliers (here: keypoints) in a scene to the
-     * corresponding 3D points. */
+     * corresponding 3D points. See mapToCloud. */
     void mapInliersToCloud(PointCloudT & keypoints3d, const tod::Guess & guess,
-                    const cv::Mat & scene2d, const PointCloudT & scene3d);
+                    const cv::Mat & scene2d, const PointCloudT & scene3d,
+                    int neighbourhood = 1);
 }
 
 #endif
@@ -51,8 +51,20 @@ namespace clutseg {
      */
     struct ClutsegParams : public Serializable {
 
+        ClutsegParams() : min_inliers(0), min_depth_ratio(0), max_extent(0) {}
+
         float accept_threshold;
         std::string ranking;
+        /** Detect choices with fewer inliers are rejected before
+         * refinement. */
+        int min_inliers;
+        /** Detect choices where a smaller fraction of inliers has valid
+         * depth are rejected before refinement. */
+        float min_depth_ratio;
+        /** Detect choices whose inliers spread over a bounding box with a
+         * side longer than this (in meters) are rejected before refinement.
+         * Zero disables the check. */
+        float max_extent;
 
         virtual void serialize(sqlite3* db);
         virtual void deserialize(sqlite3* db);
@@ -122,7 +134,11 @@ namespace clutseg {
             avg_detect_choice_matches(0), avg_detect_choice_inliers(0), detect_tp(0),
             detect_fp(0), detect_fn(0), detect_tn(0), avg_refine_guesses(0),
             avg_refine_matches(0), avg_refine_inliers(0), avg_refine_choice_matches(0),
-            avg_refine_choice_inliers(0), train_runtime(0), test_runtime(0)
+            avg_refine_choice_inliers(0), avg_extract_wall(0), p95_extract_wall(0),
+            avg_extract_cpu(0), avg_detect_wall(0), p95_detect_wall(0), avg_detect_cpu(0),
+            avg_map_wall(0), p95_map_wall(0), avg_map_cpu(0), avg_rank_wall(0),
+            p95_rank_wall(0), avg_rank_cpu(0), avg_refine_wall(0), p95_refine_wall(0),
+            avg_refine_cpu(0), train_runtime(0), test_runtime(0), test_stage_cpu(0)
             { refine_sipc = RefineSipc(); detect_sipc = DetectSipc(); }
 
         /** Average of the values returned by the response function */
@@ -193,13 +209,51 @@ namespace clutseg {
         /** Average number of inliers for the best guess object in refinement stage */
         float avg_refine_choice_inliers;
 
+        /** Average wall-clock time in seconds spent on feature extraction */
+        float avg_extract_wall;
+        /** 95th percentile of wall-clock time in seconds spent on feature extraction */
+        float p95_extract_wall;
+        /** Average processor time in seconds spent on feature extraction */
+        float avg_extract_cpu;
+        /** Average wall-clock time in seconds spent on matching and guess generation in the detection stage */
+        float avg_detect_wall;
+        /** 95th percentile of wall-clock time in seconds spent on matching and guess generation in the detection stage */
+        float p95_detect_wall;
+        /** Average processor time in seconds spent on matching and guess generation in the detection stage */
+        float avg_detect_cpu;
+        /** Average wall-clock time in seconds spent on mapping of detect choice inliers to the query cloud */
+        float avg_map_wall;
+        /** 95th percentile of wall-clock time in seconds spent on mapping of detect choice inliers to the query cloud */
+        float p95_map_wall;
+        /** Average processor time in seconds spent on mapping of detect choice inliers to the query cloud */
+        float avg_map_cpu;
+        /** Average wall-clock time in seconds spent on ranking of the detect choices */
+        float avg_rank_wall;
+        /** 95th percentile of wall-clock time in seconds spent on ranking of the detect choices */
+        float p95_rank_wall;
+        /** Average processor time in seconds spent on ranking of the detect choices */
+        float avg_rank_cpu;
+        /** Average wall-clock time in seconds spent on a single refinement attempt */
+        float avg_refine_wall;
+        /** 95th percentile of wall-clock time in seconds spent on a single refinement attempt */
+        float p95_refine_wall;
+        /** Average processor time in seconds spent on a single refinement attempt */
+        float avg_refine_cpu;
+
         /** Time in seconds that was necessary to construct train features.
          * This number might either be measured directly, or read from the cache
          * directory in case training features were loaded from cache. */
         float train_runtime;
         /** Time in seconds that was necessary to run all tests. This includes
-         * only the time spent in ClutSegmenter::recognize */
+         * only the time spent in ClutSegmenter::recognize. It is the
+         * processor time of the threads that recognized the test scenes, and
+         * therefore does not include experiments that ran concurrently on
+         * other workers, see ExperimentRunner::setWorkers. */
         float test_runtime;
+        /** Processor time in seconds spent in the stages of recognition,
+         * summed over all tests. Unlike test_runtime, it excludes work
+         * outside the stages, such as refinements that were cancelled. */
+        float test_stage_cpu;
 
         inline float fail_rate() const {
             return 1 - succ_rate;
@@ -295,20 +349,86 @@ namespace clutseg {
     void deserialize_pms_fe(sqlite3* db, tod::FeatureExtractionParams & pms_fe, int64_t & id);
     /** \brief Writes feature extraction parameters to a database. */
     void serialize_pms_fe(sqlite3* db, const tod::FeatureExtractionParams & pms_fe, int64_t & id);
+    /** \brief Returns whether two sets of feature extraction parameters are
+     * equal, i.e. whether they yield the same feature extractor. */
+    bool equal_pms_fe(const tod::FeatureExtractionParams & a, const tod::FeatureExtractionParams & b);
 
     /** \brief Reads feature matching parameters from a database. */
     void deserialize_pms_match(sqlite3* db, tod::MatcherParameters & pms_match, int64_t & id);
     /** \brief Writes feature matching parameters to a database. */
     void serialize_pms_match(sqlite3* db, const tod::MatcherParameters & pms_match, int64_t & id);
+    /** \brief Returns whether two sets of feature matching parameters are
+     * equal, i.e. whether a matcher built from one of them can be used in
+     * place of a matcher built from the other one. */
+    bool equal_pms_match(const tod::MatcherParameters & a, const tod::MatcherParameters & b);
 
     /** \brief Reads pose estimation parameters from a database. */
     void deserialize_pms_guess(sqlite3* db, tod::GuessGeneratorParameters & pms_guess, int64_t & id);
     /** \brief Writes pose estimation parameters to a database. */
     void serialize_pms_guess(sqlite3* db, const tod::GuessGeneratorParameters & pms_guess, int64_t & id);
 
-    /** \brief Reads in all experiments that have not been run yet. */ 
+    /**
+     * \brief Adds the columns that have been added to the schema since a
+     * database has been created.
+     *
+     * The scripts in schema/ only create new databases. Databases created
+     * with an earlier version of them lack columns that the records are
+     * written to, which this function adds with default values. Throws if a
+     * table does not exist at all, i.e. if the database has not been
+     * created from schema/.
+     */
+    void upgradeSchema(sqlite3* & db);
+
+    /** \brief Reads in all experiments that have not been run yet, and that
+     * are not currently claimed by a runner, see claimExperiment. */ 
     void selectExperimentsNotRun(sqlite3* & db, std::vector<Experiment> & exps);
 
+    /** \brief Counts the experiments that have not been run yet, are not
+     * skipped and are not currently claimed by a runner. Cheap enough to be
+     * polled, unlike selectExperimentsNotRun. */
+    int countExperimentsToRun(sqlite3* & db);
+
+    /**
+     * \brief Claims an experiment that has not been run yet for a runner.
+     *
+     * Returns false if another runner holds an unexpired lease on the
+     * experiment. The claim is made in a single statement, such that several
+     * processes sharing the database cannot claim the same experiment. The
+     * lease expires after lease_seconds unless it is renewed, see
+     * renewClaims, which makes the experiment available again if its runner
+     * has crashed.
+     */
+    bool claimExperiment(sqlite3* & db, int64_t id, const std::string & runner, int lease_seconds);
+
+    /** \brief Returns whether a runner holds the claim on an experiment. */
+    bool holdsClaim(sqlite3* & db, int64_t id, const std::string & runner);
+
+    /** \brief Extends the leases on all experiments a runner has claimed and
+     * not run yet. */
+    void renewClaims(sqlite3* & db, const std::string & runner, int lease_seconds);
+
+    /** \brief Gives up the claims a runner holds on experiments that have not
+     * been run. The claims on experiments that have been run are kept as a
+     * record of which runner carried them out. */
+    void releaseClaims(sqlite3* & db, const std::string & runner);
+
+    /** \brief Returns the path of the file that is written whenever
+     * experiments have been enqueued in a database, or an empty string if
+     * the database is not stored in a file. */
+    std::string enqueuedMarkerPath(sqlite3* db);
+
+    /**
+     * \brief Tells the experiment runners waiting on a database that new
+     * experiments have been enqueued.
+     *
+     * Runners watch the marker file instead of the database itself, such
+     * that they do not wake up on their own writes or on other runners
+     * renewing their claims. Call this after the experiments have been
+     * committed. Experiments inserted by other means are picked up once the
+     * waiting runners time out.
+     */
+    void notifyExperimentsEnqueued(sqlite3* db);
+
     /**
      * \brief Sorts experiments by modelbase.
      *
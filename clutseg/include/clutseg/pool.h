@@ -0,0 +1,224 @@
+/*
+ * Author: Julius Adorf
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include "clutseg/gcc_diagnostic_disable.h"
+    #include <boost/bind.hpp>
+    #include <boost/function.hpp>
+    #include <boost/thread/condition_variable.hpp>
+    #include <boost/thread/mutex.hpp>
+    #include <boost/thread/thread.hpp>
+    #include <cv.h>
+    #include <deque>
+    #include <iostream>
+    #include <vector>
+#include "clutseg/gcc_diagnostic_enable.h"
+
+namespace clutseg {
+
+    /** \brief A thread-safe pool of stateful objects.
+     *
+     * Objects such as tod::Matcher keep the state of the last query and
+     * therefore cannot be used by several threads at once. A pool hands out
+     * an object to one caller at a time and creates a new object only if all
+     * existing ones are in use. In this way, there are never more objects
+     * than concurrent callers. If the pool has a capacity, callers wait for
+     * an object to be released once that many objects have been created,
+     * such that expensive objects are not built on the hot path.
+     */
+    template <typename T>
+    class Pool {
+
+        public:
+
+            typedef boost::function<cv::Ptr<T> ()> Factory;
+
+            /** \brief Borrows an object from a pool for the lifetime of the
+             * lease, and returns it to the pool on destruction. */
+            class Lease {
+
+                public:
+
+                    Lease(Pool & pool) : pool_(pool), obj_(pool.acquire()) {}
+
+                    ~Lease() { pool_.release(obj_); }
+
+                    cv::Ptr<T> & operator*() { return obj_; }
+
+                    T * operator->() { return obj_; }
+
+                private:
+
+                    Lease(const Lease &);
+                    Lease & operator=(const Lease &);
+
+                    Pool & pool_;
+                    cv::Ptr<T> obj_;
+
+            };
+
+            /** \brief Creates an empty pool. A capacity of zero means that
+             * the number of objects is not limited. */
+            Pool(const Factory & factory, size_t capacity = 0) :
+                factory_(factory), capacity_(capacity), created_(0) {}
+
+            /** \brief Takes an idle object from the pool, or creates a new
+             * one if there is none. Blocks until an object is released if
+             * there is none and the pool is at its capacity. */
+            cv::Ptr<T> acquire() {
+                {
+                    boost::mutex::scoped_lock lock(mutex_);
+                    while (idle_.empty() && capacity_ > 0 && created_ >= capacity_) {
+                        released_.wait(lock);
+                    }
+                    if (!idle_.empty()) {
+                        cv::Ptr<T> obj = idle_.back();
+                        idle_.pop_back();
+                        return obj;
+                    }
+                    created_++;
+                }
+                // Creation can be expensive, don't block the other callers.
+                try {
+                    return factory_();
+                } catch (...) {
+                    boost::mutex::scoped_lock lock(mutex_);
+                    created_--;
+                    released_.notify_one();
+                    throw;
+                }
+            }
+
+            /** \brief Returns an object to the pool. The object is dropped
+             * if the pool holds more objects than its capacity. */
+            void release(const cv::Ptr<T> & obj) {
+                boost::mutex::scoped_lock lock(mutex_);
+                if (capacity_ > 0 && created_ > capacity_) {
+                    created_--;
+                } else {
+                    idle_.push_back(obj);
+                }
+                released_.notify_one();
+            }
+
+            size_t getCapacity() const {
+                boost::mutex::scoped_lock lock(mutex_);
+                return capacity_;
+            }
+
+            /** \brief Changes the capacity. Idle objects beyond the new
+             * capacity are dropped right away, objects in use once they are
+             * released. */
+            void setCapacity(size_t capacity) {
+                boost::mutex::scoped_lock lock(mutex_);
+                capacity_ = capacity;
+                while (capacity_ > 0 && created_ > capacity_ && !idle_.empty()) {
+                    idle_.pop_back();
+                    created_--;
+                }
+                released_.notify_all();
+            }
+
+        private:
+
+            Pool(const Pool &);
+            Pool & operator=(const Pool &);
+
+            Factory factory_;
+            size_t capacity_;
+            size_t created_;
+            mutable boost::mutex mutex_;
+            boost::condition_variable released_;
+            std::vector<cv::Ptr<T> > idle_;
+
+    };
+
+    /** \brief A fixed number of threads that run submitted tasks in the
+     * order of submission.
+     *
+     * Unlike starting threads per call, the number of threads stays the same
+     * however many callers submit tasks concurrently, so callers that would
+     * otherwise each start their own threads do not oversubscribe the
+     * processors.
+     */
+    class ThreadPool {
+
+        public:
+
+            typedef boost::function<void ()> Task;
+
+            ThreadPool(int threads) : stop_(false) {
+                for (int t = 0; t < threads; t++) {
+                    threads_.create_thread(boost::bind(&ThreadPool::work, this));
+                }
+            }
+
+            /** \brief Waits for the running tasks to finish, and drops the
+             * tasks that have not been started yet. */
+            ~ThreadPool() {
+                {
+                    boost::mutex::scoped_lock lock(mutex_);
+                    stop_ = true;
+                }
+                submitted_.notify_all();
+                threads_.join_all();
+            }
+
+            /** \brief Queues a task, which is run as soon as a thread is
+             * available. Exceptions thrown by the task are logged and
+             * otherwise ignored. */
+            void submit(const Task & task) {
+                {
+                    boost::mutex::scoped_lock lock(mutex_);
+                    tasks_.push_back(task);
+                }
+                submitted_.notify_one();
+            }
+
+            int getThreads() const {
+                return int(threads_.size());
+            }
+
+        private:
+
+            ThreadPool(const ThreadPool &);
+            ThreadPool & operator=(const ThreadPool &);
+
+            void work() {
+                while (true) {
+                    Task task;
+                    {
+                        boost::mutex::scoped_lock lock(mutex_);
+                        while (tasks_.empty() && !stop_) {
+                            submitted_.wait(lock);
+                        }
+                        if (stop_) {
+                            return;
+                        }
+                        task = tasks_.front();
+                        tasks_.pop_front();
+                    }
+                    try {
+                        task();
+                    } catch (const std::exception & e) {
+                        std::cerr << "[POOL] ERROR, task failed: " << e.what() << std::endl;
+                    } catch (...) {
+                        std::cerr << "[POOL] ERROR, task failed: unknown exception" << std::endl;
+                    }
+                }
+            }
+
+            bool stop_;
+            std::deque<Task> tasks_;
+            boost::mutex mutex_;
+            boost::condition_variable submitted_;
+            boost::thread_group threads_;
+
+    };
+
+}
+
+#endif
@@ -13,20 +13,31 @@
 
 namespace clutseg {
 
-    /** \brief A query scene. */
+    /** \brief A query scene.
+     *
+     * Both the image and the cloud are held by reference-counted handles, so
+     * copying a query is cheap and never duplicates pixel or point data.
+     * Neither is modified during recognition. */
     struct Query {
         
-        Query() : img(), cloud() {}
+        Query() : img(), cloud(new PointCloudT()) {}
+
+        /** \brief Shares the given image and cloud without copying. */
         Query(const cv::Mat & img,
-                        const PointCloudT & cloud) :
+                        const PointCloudT::ConstPtr & cloud) :
                             img(img),
                             cloud(cloud) {}
-        Query(const PointCloudT & cloud) :
+
+        /** \brief Shares the given image but copies the cloud. Prefer
+         * passing a PointCloudT::ConstPtr where the caller already owns the
+         * cloud on the heap. */
+        Query(const cv::Mat & img,
+                        const PointCloudT & cloud) :
                             img(img),
-                            cloud(cloud) {}
+                            cloud(new PointCloudT(cloud)) {}
 
         cv::Mat img;
-        PointCloudT cloud;
+        PointCloudT::ConstPtr cloud;
 
     };
 
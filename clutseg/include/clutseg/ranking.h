@@ -7,11 +7,12 @@
 
 #include "clutseg/gcc_diagnostic_disable.h"
     #include <cv.h>
+    #include <opencv_candidate/Camera.h>
     #include <tod/detecting/GuessGenerator.h>
     #include <map>
+    #include <vector>
 #include "clutseg/gcc_diagnostic_enable.h"
 
-// IDEA: create ranking by ratio between inliers and object matches
 // IDEA: create ranking by ratio between inliers and object keypoints 
 
 namespace clutseg {
@@ -30,6 +31,22 @@ namespace clutseg {
 
         virtual float operator()(const tod::Guess & guess) const = 0;
 
+        /** \brief Scores all guesses at once, such that scores[i] is the
+         * score of guesses[i].
+         *
+         * The default implementation calls operator() for each guess.
+         * Rankings override it where scoring a batch is cheaper than
+         * scoring guesses one by one. */
+        virtual void scoreAll(const std::vector<tod::Guess> & guesses,
+                                std::vector<float> & scores) const;
+
+        /** \brief Returns whether the score depends on Guess::inlierCloud.
+         *
+         * Mapping the inliers to the query cloud is not for free, so the
+         * segmenter only maps the inliers of guesses before ranking them if
+         * the ranking actually needs them. Defaults to true. */
+        virtual bool needsInlierCloud() const;
+
     };
 
     /**
@@ -38,6 +55,9 @@ namespace clutseg {
      * A comparator based on the ranking function, such that the guess with the
      * highest ranking will become the first container item after calling
      * std::sort.
+     *
+     * Note that std::sort calls the ranking function O(n log n) times. Use
+     * sortGuesses to score each guess only once.
      */
     class GuessComparator {
 
@@ -69,6 +89,8 @@ namespace clutseg {
 
         float operator()(const tod::Guess & guess) const;
 
+        bool needsInlierCloud() const;
+
     };
 
     /**
@@ -89,6 +111,8 @@ namespace clutseg {
 
             float operator()(const tod::Guess & guess) const;
 
+            bool needsInlierCloud() const;
+
         private:
 
             std::map<std::string, float> apriori_density_;
@@ -100,6 +124,8 @@ namespace clutseg {
 
         float operator()(const tod::Guess & guess) const;
 
+        bool needsInlierCloud() const;
+
     };
 
     /**
@@ -112,6 +138,11 @@ namespace clutseg {
 
         float operator()(const tod::Guess & guess) const;
 
+        /** \brief Returns the centroid of the valid points in cloud, i.e.
+         * those that are not NaN. Returns false if there are none. */
+        static bool centroid(const pcl::PointCloud<pcl::PointXYZ> & cloud,
+                                float & x, float & y, float & z);
+
     };
 
     /**
@@ -129,6 +160,11 @@ namespace clutseg {
 
             float operator()(const tod::Guess & guess) const;
 
+            void scoreAll(const std::vector<tod::Guess> & guesses,
+                            std::vector<float> & scores) const;
+
+            bool needsInlierCloud() const;
+
         private:
 
             cv::Ptr<GuessRanking> ranking1_;
@@ -137,6 +173,102 @@ namespace clutseg {
 
     };
 
+    /**
+     * \brief Ranks guesses by a linear combination of features.
+     *
+     * Each guess is described by a fixed vector of features (see
+     * LinearRanking::Feature), which is computed in a single pass over the
+     * guess. The score is the dot product with a weight vector, plus a bias.
+     * Unlike chaining rankings with ProductRanking, this costs one call per
+     * guess, no matter how many criteria are combined.
+     *
+     * The weights are meant to be learned offline, e.g. by fitting a
+     * logistic regression to the features of the detect choices recorded by
+     * ResultStorage (see scripts/result-fit-ranking). The score is then the
+     * log-odds of the guess being correct, and the acceptance threshold is
+     * on the same scale.
+     */
+    class LinearRanking : public GuessRanking {
+
+        public:
+
+            enum Feature {
+                /** Number of inliers */
+                INLIERS,
+                /** Number of matches, i.e. of correspondences between query
+                 * and template that were fed into RANSAC */
+                MATCHES,
+                /** Ratio of inliers to matches */
+                INLIER_RATIO,
+                /** Inverse distance of the inliers' centroid to the camera,
+                 * see ProximityRanking */
+                PROXIMITY,
+                /** Mean reprojection error of the inliers in pixels, i.e.
+                 * the distance between the image point of an inlier and its
+                 * aligned template point projected by the guess's pose */
+                REPROJECTION_ERROR,
+                FEATURES
+            };
+
+            /** \brief weights[0] is the bias, weights[i + 1] is the weight
+             * of feature i. Throws a runtime_error unless there are exactly
+             * FEATURES + 1 weights. The camera the query images have been
+             * taken with is needed for REPROJECTION_ERROR, see
+             * Clutsegmenter::setCamera. */
+            LinearRanking(const std::vector<float> & weights,
+                            const opencv_candidate::Camera & camera = opencv_candidate::Camera());
+
+            float operator()(const tod::Guess & guess) const;
+
+            /** \brief True unless the proximity feature is weighted zero. */
+            bool needsInlierCloud() const;
+
+            const std::vector<float> & getWeights() const;
+
+            const opencv_candidate::Camera & getCamera() const;
+
+            /** \brief Computes the features of a guess, using the given
+             * cloud of its inliers for PROXIMITY, and the given camera for
+             * REPROJECTION_ERROR. REPROJECTION_ERROR is zero if the camera
+             * matrix is empty, or if there is not one aligned template point
+             * per image point. */
+            static void features(const tod::Guess & guess,
+                                    const pcl::PointCloud<pcl::PointXYZ> & inlierCloud,
+                                    const opencv_candidate::Camera & camera,
+                                    float f[FEATURES]);
+
+        private:
+
+            std::vector<float> weights_;
+            opencv_candidate::Camera camera_;
+
+    };
+
+    /** \brief Sorts guesses such that the highest-ranked guess comes first.
+     *
+     * Each guess is scored exactly once by GuessRanking::scoreAll, then the
+     * guesses are ordered by the precomputed scores. Guesses with equal
+     * scores keep their relative order. */
+    void sortGuesses(std::vector<tod::Guess> & guesses, const GuessRanking & ranking);
+
+    /** \brief Keeps only the k highest-ranked guesses, sorted as by
+     * sortGuesses.
+     *
+     * Costs O(n log k) comparisons rather than O(n log n). The selected
+     * guesses are moved, see moveGuess, such that their points are not
+     * copied. */
+    void selectGuesses(std::vector<tod::Guess> & guesses, const GuessRanking & ranking, size_t k);
+
+    /** \brief Returns the index of the highest-ranked guess, or the first of
+     * them if there are several. guesses must not be empty. */
+    size_t bestGuess(const std::vector<tod::Guess> & guesses, const GuessRanking & ranking);
+
+    /** \brief Creates a ranking by its name, as stored in the database, e.g.
+     * "InliersRanking". A LinearRanking is given with its weights separated
+     * by whitespace, bias first, e.g. "LinearRanking -4.2 0.1 0 0 0 -0.5".
+     * Throws a runtime_error if the name is unknown. */
+    cv::Ptr<GuessRanking> createRanking(const std::string & name);
+
 }
 
 #endif
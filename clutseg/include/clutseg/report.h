@@ -28,31 +28,36 @@ namespace clutseg {
      * test report locally, e.g.  for storing results to the filesystem. */
     struct TestReport {
 
-        TestReport() {}
-
         TestReport(const Experiment & experiment,
                     const Query & query,
                     const Result & result,
                     const LabelSet & ground,
                     const std::string & img_name,
                     const boost::filesystem::path & test_dir,
-                    const opencv_candidate::Camera camera) :
+                    const opencv_candidate::Camera & camera,
+                    int map_neighbourhood = 1) :
                         experiment(experiment),
                         query(query),
                         result(result),
                         ground(ground),
                         img_name(img_name),
                         test_dir(test_dir),
-                        camera(camera) {}
+                        camera(camera),
+                        map_neighbourhood(map_neighbourhood) {}
     
         Experiment experiment;
         Query query;
-        Result result;
+        /** Refers to the result, which is usually large, rather than
+         * copying it. The report must not outlive the result. */
+        const Result & result;
         LabelSet ground;
        
         std::string img_name;
         boost::filesystem::path test_dir; 
         opencv_candidate::Camera camera;
+        /** The neighbourhood the segmenter mapped inliers to the query
+         * cloud with, see Clutsegmenter::getMapNeighbourhood */
+        int map_neighbourhood;
 
         float angle_error() const;
         float trans_error() const;
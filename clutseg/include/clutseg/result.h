@@ -22,12 +22,14 @@ namespace clutseg {
 
         Result() :  guess_made(false),
                     refine_choice(),
+                    refine_choices(0),
                     detect_choices(0),
                     features() {}
         /** This constructor is designed for testing purposes */
         Result(const tod::Guess & refine_choice) :
                     guess_made(true),
                     refine_choice(refine_choice),
+                    refine_choices(1, refine_choice),
                     detect_choices(0),
                     features() {}
         Result(bool guess_made,
@@ -36,6 +38,7 @@ namespace clutseg {
                 const tod::Features2d & features) :
                     guess_made(guess_made),
                     refine_choice(refine_choice),
+                    refine_choices(guess_made ? 1 : 0, refine_choice),
                     detect_choices(detect_choices),
                     features(features) {}
     
@@ -43,7 +46,19 @@ namespace clutseg {
          * at all. Accessing refine_choice where guess_made=false results in
          * unspecified behaviour. */
         bool guess_made;
+        /** The highest-ranked accepted guess, i.e. the first one in
+         * refine_choices. */
         tod::Guess refine_choice;
+        /** All accepted guesses, highest-ranked first, at most one per
+         * template. Holds refine_choice only, unless the segmenter runs in
+         * multi-object mode (see Clutsegmenter::isMultiObject). Empty where
+         * guess_made=false. */
+        std::vector<tod::Guess> refine_choices;
+        /** The guesses of the detection stage, highest-ranked first. Their
+         * inlierCloud is only mapped if the ranking needs it (see
+         * GuessRanking::needsInlierCloud) or the rejection gate has looked
+         * at the choice, and is empty otherwise. The accepted guesses always
+         * have their inlierCloud mapped. */
         std::vector<tod::Guess> detect_choices;
         /** The extracted features from the query image are secondary results
          * and can be used for analysis. They are kind of "leaked" by the recognizer
@@ -61,6 +76,20 @@ namespace clutseg {
      */
     typedef std::map<std::string, Result > SetResult;
 
+    /** \brief Moves a guess from src to dst without copying its inliers,
+     * inlier cloud, image points and aligned points, which are swapped
+     * instead. src is left in a valid but unspecified state.
+     *
+     * tod::Guess does not provide a swap, and copying guesses around is
+     * expensive because the containers grow with the number of inliers.
+     * Its projected points are still copied, since tod::Guess keeps them
+     * private and provides no way to modify them. */
+    void moveGuess(tod::Guess & src, tod::Guess & dst);
+
+    /** \brief Moves a result from src to dst like moveGuess, leaving src in
+     * a valid but unspecified state. */
+    void moveResult(Result & src, Result & dst);
+
 }
 
 #endif
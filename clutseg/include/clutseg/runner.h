@@ -3,11 +3,15 @@
  */
 
 #include "clutseg/clutseg.h"
+#include "clutseg/loader.h"
 #include "clutseg/modelbase.h"
 #include "clutseg/storage.h"
 
 #include "clutseg/gcc_diagnostic_disable.h"
+    #include <boost/thread/mutex.hpp>
+    #include <cv.h>
     #include <sqlite3.h>
+    #include <vector>
 #include "clutseg/gcc_diagnostic_enable.h"
 
 namespace clutseg {
@@ -18,14 +22,36 @@ namespace clutseg {
      * results.  The experiment runner polls the database for new experiments.
      * If there are any the experiments are carried out and the results written
      * to the database and the directory.
+     *
+     * Experiments that share a modelbase can be run concurrently on several
+     * workers, see ExperimentRunner::setWorkers.
+     *
+     * Several runners, possibly on different hosts, can share one database.
+     * Each experiment is claimed right before it is run, see
+     * claimExperiment, such that no experiment is run twice. Before a
+     * modelbase is trained, one of its experiments is claimed as a lock,
+     * such that no modelbase is trained by several runners at once. The
+     * leases on claimed experiments are renewed periodically while the
+     * runner is alive.
+     *
+     * The runner does not throttle itself. Its share of the machine is
+     * bounded by ExperimentRunner::setThreads, and its priority can be
+     * lowered by starting it with nice and ionice. While there is nothing
+     * to do, the runner waits to be notified of new experiments, and only
+     * checks the database every few seconds, see
+     * ExperimentRunner::POLL_SECONDS.
      */
     class ExperimentRunner {
 
         public:
 
             ExperimentRunner();
+            /** \brief Creates a runner whose test set cache may take
+             * test_set_cache_bytes, see
+             * ExperimentRunner::getTestSetCacheBytes. */
             ExperimentRunner(sqlite3* db, const ModelbaseCache & cache,
-                                const ResultStorage & storage);
+                                const ResultStorage & storage,
+                                size_t test_set_cache_bytes = size_t(1) << 30);
 
             /** Runs experiments, using configurations provided by a database.  After
              * an modelbase.has been run, the response is saved into field 'response', the
@@ -36,17 +62,128 @@ namespace clutseg {
              * account. */
             void run();
 
+            /** \brief See ExperimentRunner::getWorkers. */
+            void setWorkers(int workers);
+
+            /** \brief Returns the number of experiments that are run
+             * concurrently.
+             *
+             * All workers share the modelbase that has been loaded for the
+             * experiments, but each of them has a segmenter with parameters
+             * and statistics of its own. The matcher indices are shared as
+             * well, unless an experiment uses matcher parameters that differ
+             * from the first experiment on the same modelbase. In that case,
+             * the worker builds an index of its own. The threads are divided evenly
+             * between the workers that actually run, of which there are no
+             * more than experiments on the modelbase, see
+             * ExperimentRunner::getThreads. Defaults to one.
+             */
+            int getWorkers() const;
+
+            /** \brief See ExperimentRunner::getThreads. */
+            void setThreads(int threads);
+
+            /** \brief Returns the number of threads that recognize test
+             * scenes at the same time, over all workers. Defaults to the
+             * number of cores. */
+            int getThreads() const;
+
+            /** \brief See ExperimentRunner::getPrefetchBytes. */
+            void setPrefetchBytes(size_t prefetch_bytes);
+
+            /** \brief Returns how much memory test scenes that have been
+             * loaded ahead of recognition may take, over all workers.
+             * Defaults to 256 MB. See SceneLoader. */
+            size_t getPrefetchBytes() const;
+
+            /** \brief Returns how much memory the decoded scenes of test sets
+             * may take that are kept across experiments. Defaults to 1 GB.
+             * Fixed on construction, such that the test sets handed out
+             * by the cache stay valid. See TestSetCache. */
+            size_t getTestSetCacheBytes() const;
+
             bool terminate;
 
+            /** \brief Time in seconds until the claim on an experiment
+             * expires if it is not renewed. */
+            static const int LEASE_SECONDS = 300;
+
+            /** \brief Interval in seconds at which an idle runner checks the
+             * database for experiments to run, in addition to watching the
+             * marker file, see ExperimentRunner::waitForChange. */
+            static const int POLL_SECONDS = 5;
+
         private:
 
-            void runExperiment(Clutsegmenter & segmenter, Experiment & exp);
+            struct ExperimentQueue;
+
+            /** \brief Collects the experiments that are not skipped and share
+             * the modelbase of exps[i], starting at i. Experiments on the same
+             * modelbase are expected next to each other, see
+             * sortExperimentsByModelbase. Advances i past them and returns
+             * whether there are any. */
+            bool nextGroup(std::vector<Experiment> & exps, size_t & i, std::vector<Experiment*> & group);
+            /** \brief Trains a modelbase unless it is cached already, while
+             * holding the claim on one experiment in the group. If training
+             * fails or times out, the experiments in the group that can be
+             * claimed are marked skipped. Returns whether the modelbase can
+             * be used, which is false as well if all experiments have been
+             * claimed by other runners. */
+            bool trainModelbase(const Modelbase & tr_feat, std::vector<Experiment*> & group);
+            /** \brief Runs a group of experiments that share the
+             * modelbase prototype has been loaded from, on
+             * ExperimentRunner::getWorkers workers. Each experiment is
+             * claimed when a worker takes it, and left to other runners if
+             * it cannot be claimed. Returns the number of experiments that
+             * have been run and whose results have been recorded. */
+            size_t runExperiments(Clutsegmenter & prototype, std::vector<Experiment*> & exps);
+            void experimentWorker(const Clutsegmenter & prototype, ExperimentQueue & queue);
+            /** \brief Runs an experiment on the share of the threads and of
+             * the prefetch budget of one out of the given number of workers
+             * that run concurrently. */
+            void runExperiment(Clutsegmenter & segmenter, Experiment & exp, size_t workers);
+            /** \brief Marks a claimed experiment as skipped, with the error
+             * as machine note, and writes it to the database. Does not
+             * throw. */
+            void markFailed(Experiment & exp, const std::string & error);
+            /** \brief Writes an experiment to the database. Safe to call from
+             * several workers. If claimed is true, nothing is written unless
+             * this runner still holds the claim on the experiment. Returns
+             * whether the experiment has been written. */
+            bool serializeExperiment(Experiment & exp, bool claimed = false);
+            /** \brief Claims an experiment for this runner, see
+             * clutseg::claimExperiment. Returns true as well if this runner
+             * holds the claim already. Logs and returns false if the
+             * experiment cannot be claimed. Does not throw. */
+            bool claimExperiment(const Experiment & exp);
+            void releaseClaims();
+            void renewClaimsPeriodically();
+            /** \brief Blocks until there are experiments to run, or until the
+             * runner is terminated.
+             *
+             * Wakes up right away if the marker file is written, given an
+             * inotify descriptor watching it, see notifyExperimentsEnqueued.
+             * Notifications from other hosts are not seen on shared file
+             * systems, and fd may be -1 if the file cannot be watched, so
+             * the database is polled every ExperimentRunner::POLL_SECONDS as
+             * well, see countExperimentsToRun. This also picks up experiments
+             * whose runner has crashed once their lease expires. */
+            void waitForChange(int fd);
             void skipExperimentsWhereNoFeaturesExtracted(std::vector<Experiment> & exps);
             void skipExperimentsWhereFeatureExtractorCreateFailed(std::vector<Experiment> & exps);
 
             sqlite3* db_;
+            /** \brief Guards db_. Serializing an experiment takes several
+             * statements that rely on the last inserted row id of the
+             * connection, so they must not interleave. */
+            cv::Ptr<boost::mutex> db_mutex_;
             ModelbaseCache cache_;
             ResultStorage storage_;
+            int workers_;
+            int threads_;
+            size_t prefetch_bytes_;
+            cv::Ptr<TestSetCache> test_sets_;
+            std::string runner_id_;
 
     };
 
@@ -0,0 +1,79 @@
+/*
+ * Author: Julius Adorf
+ */
+
+#ifndef _TIMING_H_
+#define _TIMING_H_
+
+#include "clutseg/gcc_diagnostic_disable.h"
+    #include <ctime>
+#include "clutseg/gcc_diagnostic_enable.h"
+
+namespace clutseg {
+
+    /** \brief Measures elapsed wall-clock time and the processor time of the
+     * calling thread since construction or the last call to
+     * Stopwatch::restart. */
+    class Stopwatch {
+
+        public:
+
+            Stopwatch();
+
+            void restart();
+
+            /** \brief Elapsed wall-clock time in seconds. */
+            double wall() const;
+
+            /** \brief Processor time in seconds consumed by the calling
+             * thread. Must be called from the thread that started the
+             * stopwatch. */
+            double cpu() const;
+
+        private:
+
+            timespec wall_;
+            timespec cpu_;
+
+    };
+
+    /** \brief Accumulates latencies of a single processing stage.
+     *
+     * Wall-clock times are additionally collected in a histogram with
+     * logarithmically spaced bins, four per octave, starting at one
+     * microsecond. This allows for estimating percentiles at a relative
+     * resolution of about 19%, using constant memory.
+     */
+    struct LatencyStats {
+
+        static const int BINS = 128;
+
+        LatencyStats();
+
+        /** \brief Records a single measurement. */
+        void add(double wall, double cpu);
+
+        /** \brief Records the time measured by a stopwatch. */
+        void add(const Stopwatch & watch);
+
+        LatencyStats & operator+=(const LatencyStats & rhs);
+
+        double avgWall() const;
+
+        double avgCpu() const;
+
+        /** \brief Estimates the p-th percentile (0 < p <= 1) of the recorded
+         * wall-clock times, returning the upper bound of the histogram bin
+         * the percentile falls in. Returns 0 if there are no measurements. */
+        double wallPercentile(double p) const;
+
+        long count;
+        double acc_wall;
+        double acc_cpu;
+        long hist[BINS];
+
+    };
+
+}
+
+#endif
@@ -11,6 +11,8 @@ create table experiment (
     machine_note varchar(255) DEFAULT(''),
     batch varchar(255) DEFAULT(''),
     skip boolean default 0,
-    flags integer default 0
+    flags integer default 0,
+    claimed_by varchar(255) default null,
+    lease_expires datetime default null
 );
 
@@ -2,6 +2,9 @@
 create table pms_clutseg (
     id integer primary key autoincrement,
     accept_threshold float,
-    ranking varchar(255)
+    ranking varchar(255),
+    min_inliers integer default 0,
+    min_depth_ratio float default 0,
+    max_extent float default 0
 );
 
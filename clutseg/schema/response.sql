@@ -38,8 +38,25 @@ create table response (
     avg_refine_inliers float not null,
     avg_refine_choice_matches float not null,
     avg_refine_choice_inliers float not null,
+    -- latency stats per stage, in seconds
+    avg_extract_wall float not null,
+    p95_extract_wall float not null,
+    avg_extract_cpu float not null,
+    avg_detect_wall float not null,
+    p95_detect_wall float not null,
+    avg_detect_cpu float not null,
+    avg_map_wall float not null,
+    p95_map_wall float not null,
+    avg_map_cpu float not null,
+    avg_rank_wall float not null,
+    p95_rank_wall float not null,
+    avg_rank_cpu float not null,
+    avg_refine_wall float not null,
+    p95_refine_wall float not null,
+    avg_refine_cpu float not null,
     -- timing stats --
     train_runtime float not null,
-    test_runtime float not null
+    test_runtime float not null,
+    test_stage_cpu float not null default 0
 );
 
@@ -9,7 +9,12 @@
 
 #include "clutseg/gcc_diagnostic_disable.h"
 #include <tod/detecting/Loader.h>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <cfloat>
 #include <limits>
 #include <cstdlib>
 #include "clutseg/gcc_diagnostic_enable.h"
@@ -21,13 +26,39 @@ using namespace tod;
 
 namespace clutseg {
 
-    Clutsegmenter::Clutsegmenter() : initialized_(false) {}
+    Clutsegmenter::Clutsegmenter() : stats_mutex_(new boost::mutex()),
+                                    cache_mutex_(new boost::mutex()),
+                                    cache_built_(new boost::condition_variable()),
+                                    min_inliers_(0),
+                                    min_depth_ratio_(0),
+                                    max_extent_(0),
+                                    refine_threads_(1),
+                                    matcher_pool_capacity_(2),
+                                    map_neighbourhood_(1),
+                                    max_detect_choices_(0),
+                                    multi_object_(false),
+                                    initialized_(false),
+                                    has_camera_(false),
+                                    building_detect_matchers_(false) {}
 
     Clutsegmenter::Clutsegmenter(const std::string & baseDirectory, bool tar) :
+                                    stats_mutex_(new boost::mutex()),
+                                    cache_mutex_(new boost::mutex()),
+                                    cache_built_(new boost::condition_variable()),
                                     ranking_(new InliersRanking()),
                                     accept_threshold_(10),
+                                    min_inliers_(0),
+                                    min_depth_ratio_(0),
+                                    max_extent_(0),
                                     do_refine_(true),
-                                    initialized_(true) {
+                                    refine_threads_(1),
+                                    matcher_pool_capacity_(2),
+                                    map_neighbourhood_(1),
+                                    max_detect_choices_(0),
+                                    multi_object_(false),
+                                    initialized_(true),
+                                    has_camera_(false),
+                                    building_detect_matchers_(false) {
         if (tar) {
             char tmp[19] = "/tmp/clutsegXXXXXX";
             if (mkdtemp(tmp) == NULL) {
@@ -46,6 +77,7 @@ namespace clutseg {
         loadParams(baseDirectory_ + "/detect.config.yaml", detect_params_);
         loadParams(baseDirectory_ + "/refine.config.yaml", refine_params_);
         loadBase();
+        loadCamera();
         
         if (tar) {
             cout << "[CLUTSEG]: Removing directory " << baseDirectory_ << endl;
@@ -60,14 +92,28 @@ namespace clutseg {
                                     Ptr<GuessRanking> ranking,
                                     float accept_threshold,
                                     bool do_refine) :
+                                stats_mutex_(new boost::mutex()),
+                                cache_mutex_(new boost::mutex()),
+                                cache_built_(new boost::condition_variable()),
                                 baseDirectory_(baseDirectory),
                                 ranking_(ranking),
                                 accept_threshold_(accept_threshold),
+                                min_inliers_(0),
+                                min_depth_ratio_(0),
+                                max_extent_(0),
                                 do_refine_(do_refine),
-                                initialized_(true) {
+                                refine_threads_(1),
+                                matcher_pool_capacity_(2),
+                                map_neighbourhood_(1),
+                                max_detect_choices_(0),
+                                multi_object_(false),
+                                initialized_(true),
+                                has_camera_(false),
+                                building_detect_matchers_(false) {
         loadParams(detect_config, detect_params_);
         loadParams(refine_config, refine_params_);
         loadBase();
+        loadCamera();
     }
 
     Clutsegmenter::Clutsegmenter(const string & baseDirectory,
@@ -76,14 +122,28 @@ namespace clutseg {
                                     Ptr<GuessRanking> ranking,
                                     float accept_threshold,
                                     bool do_refine) :
+                                stats_mutex_(new boost::mutex()),
+                                cache_mutex_(new boost::mutex()),
+                                cache_built_(new boost::condition_variable()),
                                 baseDirectory_(baseDirectory),
                                 detect_params_(detect_params),
                                 refine_params_(refine_params),
                                 ranking_(ranking),
                                 accept_threshold_(accept_threshold),
+                                min_inliers_(0),
+                                min_depth_ratio_(0),
+                                max_extent_(0),
                                 do_refine_(do_refine),
-                                initialized_(true) {
+                                refine_threads_(1),
+                                matcher_pool_capacity_(2),
+                                map_neighbourhood_(1),
+                                max_detect_choices_(0),
+                                multi_object_(false),
+                                initialized_(true),
+                                has_camera_(false),
+                                building_detect_matchers_(false) {
         loadBase();
+        loadCamera();
     }
 
     void Clutsegmenter::loadParams(const string & config, TODParameters & params) {
@@ -95,10 +155,136 @@ namespace clutseg {
         fs.release();
     }
 
+    void Clutsegmenter::loadCamera() {
+        string fn = baseDirectory_ + "/camera.yml";
+        if (boost::filesystem::exists(fn)) {
+            camera_ = Camera(fn, Camera::TOD_YAML);
+            has_camera_ = true;
+            bindCamera();
+        }
+    }
+
     void Clutsegmenter::loadBase() {
         Loader loader(baseDirectory_);
         loader.readTexturedObjects(objects_);
-        base_ = TrainingBase(objects_);
+        base_ = new TrainingBase(objects_);
+        boost::mutex::scoped_lock lock(*cache_mutex_);
+        detect_matchers_.release();
+        refine_models_.clear();
+    }
+
+    static Ptr<Matcher> buildMatcher(const MatcherParameters & params, const Ptr<TrainingBase> & base) {
+        Ptr<Matcher> matcher = Matcher::create(params);
+        matcher->add(*base);
+        return matcher;
+    }
+
+    Ptr<Clutsegmenter::ExtractorPool> Clutsegmenter::getExtractors() {
+        boost::mutex::scoped_lock lock(*cache_mutex_);
+        if (extractors_.empty() || !equal_pms_fe(extractor_params_, detect_params_.feParams)) {
+            extractors_ = new ExtractorPool(boost::bind(FeatureExtractor::create, detect_params_.feParams));
+            extractor_params_ = detect_params_.feParams;
+        }
+        return extractors_;
+    }
+
+    Ptr<Clutsegmenter::MatcherPool> Clutsegmenter::getDetectMatchers() {
+        Ptr<MatcherPool> matchers;
+        MatcherParameters params;
+        size_t capacity;
+        {
+            boost::mutex::scoped_lock lock(*cache_mutex_);
+            while (building_detect_matchers_) {
+                cache_built_->wait(lock);
+            }
+            if (!detect_matchers_.empty() && equal_pms_match(detect_matcher_params_, detect_params_.matcherParams)) {
+                return detect_matchers_;
+            }
+            building_detect_matchers_ = true;
+            params = detect_params_.matcherParams;
+            capacity = matcher_pool_capacity_;
+        }
+        // Build the first index right away, such that it is already in
+        // place when the next queries come in, but without blocking the
+        // callers that need other cached state.
+        cout << "[CLUTSEG] Building detect matcher index" << endl;
+        try {
+            matchers = new MatcherPool(boost::bind(buildMatcher, params, base_), capacity);
+            matchers->release(matchers->acquire());
+        } catch (...) {
+            boost::mutex::scoped_lock lock(*cache_mutex_);
+            building_detect_matchers_ = false;
+            cache_built_->notify_all();
+            throw;
+        }
+        boost::mutex::scoped_lock lock(*cache_mutex_);
+        detect_matchers_ = matchers;
+        detect_matcher_params_ = params;
+        building_detect_matchers_ = false;
+        cache_built_->notify_all();
+        return matchers;
+    }
+
+    Clutsegmenter::RefineModel Clutsegmenter::getRefineModel(const string & name) {
+        MatcherParameters params;
+        size_t capacity;
+        {
+            boost::mutex::scoped_lock lock(*cache_mutex_);
+            while (true) {
+                if (!equal_pms_match(refine_matcher_params_, refine_params_.matcherParams)) {
+                    refine_models_.clear();
+                    refine_matcher_params_ = refine_params_.matcherParams;
+                }
+                map<string, RefineModel>::iterator it = refine_models_.find(name);
+                if (it != refine_models_.end()) {
+                    return it->second;
+                }
+                if (building_refine_models_.count(name) == 0) {
+                    break;
+                }
+                cache_built_->wait(lock);
+            }
+            building_refine_models_.insert(name);
+            params = refine_matcher_params_;
+            capacity = matcher_pool_capacity_;
+        }
+        RefineModel model;
+        try {
+            vector<Ptr<TexturedObject> > so;
+            BOOST_FOREACH(const Ptr<TexturedObject> & obj, objects_) {
+                if (obj->name == name) {
+                    // Create a new textured object instance --- those thingies
+                    // cannot exist in multiple training bases, this breaks indices
+                    // that are tightly coupled between TrainingBase and
+                    // TexturedObject instances.
+                    Ptr<TexturedObject> newObj = new TexturedObject();
+                    newObj->id = 0;
+                    newObj->name = obj->name;
+                    newObj->directory_ = obj->directory_;
+                    newObj->stddev = obj->stddev;
+                    newObj->observations = obj->observations;
+                    so.push_back(newObj);
+                    break;
+                }
+            }
+            cout << "[CLUTSEG] Building refine matcher index for " << name << endl;
+            model.base = new TrainingBase(so);
+            model.matchers = new MatcherPool(boost::bind(buildMatcher, params, model.base), capacity);
+        } catch (...) {
+            boost::mutex::scoped_lock lock(*cache_mutex_);
+            building_refine_models_.erase(name);
+            cache_built_->notify_all();
+            throw;
+        }
+        boost::mutex::scoped_lock lock(*cache_mutex_);
+        // Models built with parameters that have changed meanwhile are
+        // handed out to this caller, but not cached.
+        if (equal_pms_match(refine_matcher_params_, params)) {
+            refine_models_[name] = model;
+        }
+        building_refine_models_.erase(name);
+        cache_built_->notify_all();
+        return model;
     }
 
     TODParameters & Clutsegmenter::getDetectParams() {
@@ -117,12 +303,29 @@ namespace clutseg {
         accept_threshold_ = accept_threshold;
     }
 
+    void Clutsegmenter::setRejectionGate(int min_inliers, float min_depth_ratio, float max_extent) {
+        min_inliers_ = min_inliers;
+        min_depth_ratio_ = min_depth_ratio;
+        max_extent_ = max_extent;
+    }
+
     Ptr<GuessRanking> Clutsegmenter::getRanking() const {
         return ranking_;
     }
 
     void Clutsegmenter::setRanking(const Ptr<GuessRanking> & ranking) {
         ranking_ = ranking;
+        ranking_name_.clear();
+        bindCamera();
+    }
+
+    void Clutsegmenter::bindCamera() {
+        // The ranking may be shared with copies of this segmenter that
+        // recognize concurrently, so it is replaced rather than modified.
+        const LinearRanking * linear = dynamic_cast<const LinearRanking *>((const GuessRanking *) ranking_);
+        if (linear != NULL && has_camera_) {
+            ranking_ = new LinearRanking(linear->getWeights(), camera_);
+        }
     }
 
     set<string> Clutsegmenter::getTemplateNames() const {
@@ -134,26 +337,60 @@ namespace clutseg {
     }
 
     void Clutsegmenter::reconfigure(const Paramset & paramset) {
-        detect_params_ = paramset.toDetectTodParameters();
-        refine_params_ = paramset.toRefineTodParameters();
+        TODParameters detect_params = paramset.toDetectTodParameters();
+        TODParameters refine_params = paramset.toRefineTodParameters();
+
+        // Only throw away state that depends on parameters that actually
+        // changed, such that a parameter sweep keeps the matcher indices.
+        // Pose estimation parameters are read on every query, so there is
+        // nothing to rebuild if they change.
+        {
+            boost::mutex::scoped_lock lock(*cache_mutex_);
+            if (!extractors_.empty() && !equal_pms_fe(extractor_params_, detect_params.feParams)) {
+                cout << "[CLUTSEG] Feature extraction parameters changed, dropping feature extractors" << endl;
+                extractors_.release();
+            }
+            if (!detect_matchers_.empty() && !equal_pms_match(detect_matcher_params_, detect_params.matcherParams)) {
+                cout << "[CLUTSEG] Detect matcher parameters changed, dropping matcher index" << endl;
+                detect_matchers_.release();
+            }
+            if (!refine_models_.empty() && !equal_pms_match(refine_matcher_params_, refine_params.matcherParams)) {
+                cout << "[CLUTSEG] Refine matcher parameters changed, dropping matcher indices" << endl;
+                refine_models_.clear();
+            }
+        }
+        detect_params_ = detect_params;
+        refine_params_ = refine_params;
+
         string r = paramset.pms_clutseg.ranking;
-        if (r == "InliersRanking") {
-            ranking_ = new InliersRanking(); 
-        } else if (r == "ProximityRanking") {
-            ranking_ = new ProximityRanking();
-        } else if (r == "UniformRanking") {
-            ranking_ = new UniformRanking();
-        } else {
-            throw runtime_error("Unknown ranking: " + r);
+        if (ranking_.empty() || r != ranking_name_) {
+            ranking_ = createRanking(r);
+            ranking_name_ = r;
+            bindCamera();
         }
         accept_threshold_ = paramset.pms_clutseg.accept_threshold;
+        setRejectionGate(paramset.pms_clutseg.min_inliers,
+                            paramset.pms_clutseg.min_depth_ratio,
+                            paramset.pms_clutseg.max_extent);
+    }
+
+    void Clutsegmenter::prepare() {
+        getExtractors();
+        getDetectMatchers();
+        if (do_refine_) {
+            BOOST_FOREACH(const string & name, getTemplateNames()) {
+                getRefineModel(name);
+            }
+        }
     }
 
     void Clutsegmenter::resetStats() {
+        boost::mutex::scoped_lock lock(*stats_mutex_);
         stats_ = ClutsegmenterStats();
     }
 
     ClutsegmenterStats Clutsegmenter::getStats() const {
+        boost::mutex::scoped_lock lock(*stats_mutex_);
         return stats_;
     }
 
@@ -165,64 +402,532 @@ namespace clutseg {
         return do_refine_;
     }
 
+    void Clutsegmenter::setRefineThreads(int refine_threads) {
+        refine_threads_ = refine_threads;
+        // The calling thread refines as well
+        if (refine_threads_ > 1) {
+            refine_pool_ = new ThreadPool(refine_threads_ - 1);
+        } else {
+            refine_pool_.release();
+        }
+    }
+
+    int Clutsegmenter::getRefineThreads() const {
+        return refine_threads_;
+    }
+
+    void Clutsegmenter::setMatcherPoolCapacity(int capacity) {
+        boost::mutex::scoped_lock lock(*cache_mutex_);
+        matcher_pool_capacity_ = max(1, capacity);
+        if (!detect_matchers_.empty()) {
+            detect_matchers_->setCapacity(matcher_pool_capacity_);
+        }
+        for (map<string, RefineModel>::iterator it = refine_models_.begin(); it != refine_models_.end(); it++) {
+            it->second.matchers->setCapacity(matcher_pool_capacity_);
+        }
+    }
+
+    int Clutsegmenter::getMatcherPoolCapacity() const {
+        boost::mutex::scoped_lock lock(*cache_mutex_);
+        return matcher_pool_capacity_;
+    }
+
+    void Clutsegmenter::setMapNeighbourhood(int map_neighbourhood) {
+        map_neighbourhood_ = map_neighbourhood;
+    }
+
+    int Clutsegmenter::getMapNeighbourhood() const {
+        return map_neighbourhood_;
+    }
+
+    void Clutsegmenter::setMaxDetectChoices(int max_detect_choices) {
+        max_detect_choices_ = max_detect_choices;
+    }
+
+    int Clutsegmenter::getMaxDetectChoices() const {
+        return max_detect_choices_;
+    }
+
+    void Clutsegmenter::setMultiObject(bool multi_object) {
+        multi_object_ = multi_object;
+    }
+
+    bool Clutsegmenter::isMultiObject() const {
+        return multi_object_;
+    }
+
+    const Camera & Clutsegmenter::getCamera() const {
+        return camera_;
+    }
+
+    void Clutsegmenter::setCamera(const Camera & camera) {
+        camera_ = camera;
+        has_camera_ = true;
+        bindCamera();
+    }
+
     void Clutsegmenter::recognize(const Query & query, Result & result) {
+        ClutsegmenterStats stats;
+        recognize(query, result, stats);
+        boost::mutex::scoped_lock lock(*stats_mutex_);
+        stats_ += stats;
+    }
+
+    void Clutsegmenter::recognize(const Query & query, Result & result, ClutsegmenterStats & stats) {
+        if (!has_camera_) {
+            throw runtime_error("No camera parameters, neither camera.yml in the modelbase nor Clutsegmenter::setCamera");
+        }
+
         { /* begin statistics */ 
-            stats_.queries++;
+            stats.queries++;
         } /* end statistics */
+        Stopwatch total;
 
-        Features2d f2d;
+        // Extract the features right into the result, rather than copying
+        // them there afterwards.
+        result.features = Features2d();
+        Features2d & f2d = result.features;
         f2d.image = query.img;
-        // TODO: document or inject intrinsic camera parameters
-        f2d.camera = Camera("./data/camera.yml", Camera::TOD_YAML);
+        f2d.camera = camera_;
         
         // Generate a couple of guesses. Ideally, each object on the scene is
         // detected and there are no misclassifications.
         vector<pair<int, int> > ds;
-        detect(f2d, result.detect_choices, ds);
+        detect(f2d, result.detect_choices, ds, stats);
 
-        result.features = f2d;
-
-        BOOST_FOREACH(Guess & g, result.detect_choices) {
-            mapInliersToCloud(g.inlierCloud, g, query.img, query.cloud);
+        // Only map the inliers of all detect choices if the ranking needs
+        // them, otherwise do so only for the accepted ones in the end.
+        bool map_all = ranking_->needsInlierCloud();
+        Stopwatch watch;
+        if (map_all) {
+            BOOST_FOREACH(Guess & g, result.detect_choices) {
+                mapInliersToCloud(g.inlierCloud, g, query.img, *query.cloud, map_neighbourhood_);
+            }
+            stats.map_latency.add(watch);
         }
 
         if (!result.detect_choices.empty()) {
             // Sort the guesses according to the ranking function.
-            sort(result.detect_choices.begin(), result.detect_choices.end(), GuessComparator(ranking_));
+            watch.restart();
+            if (max_detect_choices_ > 0) {
+                selectGuesses(result.detect_choices, *ranking_, max_detect_choices_);
+            } else {
+                sortGuesses(result.detect_choices, *ranking_);
+            }
+            stats.rank_latency.add(watch);
             // Iterate over every guess, beginning with the highest ranked
             // guess. If the guess resulting of locating the object got a score
             // larger than the acceptance threshold, this is our best guess.
-            for (size_t i = 0; i < result.detect_choices.size(); i++) {
-                result.refine_choice = result.detect_choices[i]; 
+            if (do_refine_ && refine_threads_ > 1) {
+                refineParallel(f2d, *query.cloud, ds, result, stats);
+            } else if (multi_object_) {
+                // Same as above, but keep going and find the best guess for
+                // every other template on the scene as well.
+                set<string> found;
+                result.refine_choices.reserve(result.detect_choices.size());
+                for (size_t i = 0; i < result.detect_choices.size(); i++) {
+                    const string & name = result.detect_choices[i].getObject()->name;
+                    if (found.count(name) == 0) {
+                        vector<pair<int, int> > ls; 
+                        Guess refineChoice;
+                        if (tryChoice(f2d, *query.cloud, result.detect_choices[i], refineChoice, ls, stats)) {
+                            acceptChoice(result, i, refineChoice, ds, ls, stats);
+                            found.insert(name);
+                        }
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < result.detect_choices.size(); i++) {
+                    vector<pair<int, int> > ls; 
+                    Guess refineChoice;
+                    if (tryChoice(f2d, *query.cloud, result.detect_choices[i], refineChoice, ls, stats)) {
+                        acceptChoice(result, i, refineChoice, ds, ls, stats);
+                        break;
+                    }
+                }
+            }
+        }
 
-                vector<pair<int, int> > ls; 
-                if (do_refine_) {
-                    refine(f2d, query.cloud, result.refine_choice, ls);
+        // Accepted detect choices may have been mapped by the rejection
+        // gate already.
+        if (!map_all && result.guess_made) {
+            watch.restart();
+            BOOST_FOREACH(Guess & g, result.refine_choices) {
+                if (g.inlierCloud.empty()) {
+                    mapInliersToCloud(g.inlierCloud, g, query.img, *query.cloud, map_neighbourhood_);
                 }
+            }
+            stats.map_latency.add(watch);
+        }
+        if (result.guess_made) {
+            result.refine_choice = result.refine_choices.front();
+        }
+        stats.recognize_latency.add(total);
+    }
 
-                cout << "[CLUTSEG] ranking: " << (*ranking_)(result.refine_choice) << endl;
-                cout << "[CLUTSEG] accept_threshold: " << accept_threshold_ << endl;
+    /** \brief Shared state of the workers in Clutsegmenter::recognizeBatch. */
+    struct Clutsegmenter::BatchJob {
 
-                if ((*ranking_)(result.refine_choice) >= accept_threshold_) {
-                    cout << "[CLUTSEG] Inliers before:  " << result.detect_choices[i].inliers.size() << ", and after: " << result.refine_choice.inliers.size() << endl;
+        BatchJob(const vector<Query> & queries, vector<Result> & results) :
+                        queries(queries),
+                        results(results),
+                        stats(queries.size()),
+                        next(0) {}
 
-                    { /* begin statistics */ 
-                        stats_.acc_detect_choice_matches += ds[result.detect_choices[i].getObject()->id].second;
-                        stats_.acc_detect_choice_inliers += result.detect_choices[i].inliers.size();
-                        if (do_refine_) {
-                            stats_.acc_refine_choice_matches += ls[result.refine_choice.getObject()->id].second;
-                            stats_.acc_refine_choice_inliers += result.refine_choice.inliers.size();
-                        } 
-                        stats_.choices++;
-                    } /* end statistics */
+        const vector<Query> & queries;
+        vector<Result> & results;
+        vector<ClutsegmenterStats> stats;
 
-                    result.guess_made = true;
-                    break;
+        boost::mutex mutex;
+        /** Index of the next query to recognize. */
+        size_t next;
+        /** Message of the first exception thrown by a worker, if any. */
+        string error;
+
+    };
+
+    void Clutsegmenter::batchWorker(BatchJob & job) {
+        while (true) {
+            size_t i;
+            {
+                boost::mutex::scoped_lock lock(job.mutex);
+                if (job.next >= job.queries.size() || !job.error.empty()) {
+                    return;
+                }
+                i = job.next++;
+            }
+            try {
+                recognize(job.queries[i], job.results[i], job.stats[i]);
+            } catch (const exception & e) {
+                boost::mutex::scoped_lock lock(job.mutex);
+                if (job.error.empty()) {
+                    job.error = e.what();
+                }
+            } catch (...) {
+                boost::mutex::scoped_lock lock(job.mutex);
+                if (job.error.empty()) {
+                    job.error = "unknown exception";
+                }
+            }
+        }
+    }
+
+    void Clutsegmenter::recognizeBatch(const vector<Query> & queries, vector<Result> & results, int threads) {
+        if (!has_camera_) {
+            throw runtime_error("No camera parameters, neither camera.yml in the modelbase nor Clutsegmenter::setCamera");
+        }
+        results.assign(queries.size(), Result());
+        if (threads <= 0) {
+            threads = max(1u, boost::thread::hardware_concurrency());
+        }
+
+        BatchJob job(queries, results);
+        size_t n = min(size_t(threads), queries.size());
+        boost::thread_group workers;
+        for (size_t t = 0; t < n; t++) {
+            workers.create_thread(boost::bind(&Clutsegmenter::batchWorker, this, boost::ref(job)));
+        }
+        workers.join_all();
+
+        if (!job.error.empty()) {
+            throw runtime_error("Batch recognition failed: " + job.error);
+        }
+
+        boost::mutex::scoped_lock lock(*stats_mutex_);
+        BOOST_FOREACH(const ClutsegmenterStats & stats, job.stats) {
+            stats_ += stats;
+        }
+    }
+
+    bool Clutsegmenter::isPlausible(const Features2d & queryF2d,
+                                    const PointCloudT & queryCloud,
+                                    Guess & detectChoice) const {
+        size_t n = detectChoice.inliers.size();
+        if (n < size_t(max(0, min_inliers_))) {
+            return false;
+        }
+        if (n == 0 || (min_depth_ratio_ <= 0 && max_extent_ <= 0)) {
+            return true;
+        }
+
+        // The inliers of detect choices are only mapped to the query cloud
+        // in advance if the ranking needs them. Keep them, such that a
+        // choice accepted without refinement is not mapped again.
+        if (detectChoice.inlierCloud.empty()) {
+            mapInliersToCloud(detectChoice.inlierCloud, detectChoice, queryF2d.image, queryCloud, map_neighbourhood_);
+        }
+
+        size_t valid = 0;
+        float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+        float hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        BOOST_FOREACH(const PointXYZ & p, detectChoice.inlierCloud.points) {
+            if (p.z == p.z) {
+                valid++;
+                for (int d = 0; d < 3; d++) {
+                    lo[d] = min(lo[d], p.data[d]);
+                    hi[d] = max(hi[d], p.data[d]);
+                }
+            }
+        }
+        if (valid < min_depth_ratio_ * n) {
+            return false;
+        }
+        if (max_extent_ > 0 && valid > 0) {
+            for (int d = 0; d < 3; d++) {
+                if (hi[d] - lo[d] > max_extent_) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool Clutsegmenter::tryChoice(const Features2d & queryF2d, const PointCloudT & queryCloud,
+                                    Guess & detectChoice, Guess & refineChoice,
+                                    vector<pair<int, int> > & matches,
+                                    ClutsegmenterStats & stats) {
+        if (!isPlausible(queryF2d, queryCloud, detectChoice)) {
+            cout << "[CLUTSEG] Rejected implausible detect choice of " << detectChoice.getObject()->name << endl;
+            stats.rejected_choices++;
+            return false;
+        }
+
+        // Falls back to the detect choice if refinement is disabled or fails
+        const Guess * choice = &detectChoice;
+        if (do_refine_) {
+            Stopwatch watch;
+            if (refine(queryF2d, queryCloud, detectChoice, refineChoice, matches, stats)) {
+                choice = &refineChoice;
+            }
+            stats.refine_latency.add(watch);
+        }
+
+        float score = (*ranking_)(*choice);
+        cout << "[CLUTSEG] ranking: " << score << endl;
+        cout << "[CLUTSEG] accept_threshold: " << accept_threshold_ << endl;
+        bool accepted = score >= accept_threshold_;
+        if (accepted && choice == &detectChoice) {
+            // Copy the detect choice only if it is actually returned
+            refineChoice = detectChoice;
+        }
+        return accepted;
+    }
+
+    void Clutsegmenter::acceptChoice(Result & result, size_t i,
+                                    Guess & refineChoice,
+                                    const vector<pair<int, int> > & ds,
+                                    const vector<pair<int, int> > & ls,
+                                    ClutsegmenterStats & stats) {
+        cout << "[CLUTSEG] Inliers before:  " << result.detect_choices[i].inliers.size() << ", and after: " << refineChoice.inliers.size() << endl;
+
+        { /* begin statistics */ 
+            stats.acc_detect_choice_matches += ds[result.detect_choices[i].getObject()->id].second;
+            stats.acc_detect_choice_inliers += result.detect_choices[i].inliers.size();
+            if (do_refine_) {
+                stats.acc_refine_choice_matches += ls[refineChoice.getObject()->id].second;
+                stats.acc_refine_choice_inliers += refineChoice.inliers.size();
+            } 
+            stats.choices++;
+        } /* end statistics */
+
+        result.refine_choices.push_back(Guess());
+        moveGuess(refineChoice, result.refine_choices.back());
+        result.guess_made = true;
+    }
+
+    /** \brief Shared state of the workers in Clutsegmenter::refineParallel. */
+    struct Clutsegmenter::RefineJob {
+
+        RefineJob(const Features2d & features,
+                    const PointCloudT & cloud,
+                    vector<Guess> & detect_choices,
+                    bool multi_object) :
+                        features(features),
+                        cloud(cloud),
+                        detect_choices(detect_choices),
+                        multi_object(multi_object),
+                        next(0),
+                        accepted(detect_choices.size()),
+                        passed(detect_choices.size(), false),
+                        refine_choices(detect_choices.size()),
+                        matches(detect_choices.size()),
+                        stats(detect_choices.size()),
+                        cpu(0),
+                        closed(false),
+                        active(0) {}
+
+        const string & name(size_t i) const {
+            return detect_choices[i].getObject()->name;
+        }
+
+        const Features2d & features;
+        const PointCloudT & cloud;
+        /** Each choice is only touched by the worker that tries it. */
+        vector<Guess> & detect_choices;
+        bool multi_object;
+
+        boost::mutex mutex;
+        /** Index of the next detect choice to refine. */
+        size_t next;
+        /** Index of the highest-ranked accepted detect choice so far, or
+         * detect_choices.size() if none has been accepted yet. Not used in
+         * multi-object mode, where all choices need to be tried. */
+        size_t accepted;
+        /** Templates for which a choice has been accepted so far. */
+        set<string> found;
+
+        vector<bool> passed;
+        vector<Guess> refine_choices;
+        vector<vector<pair<int, int> > > matches;
+        vector<ClutsegmenterStats> stats;
+        /** Processor time in seconds consumed by the pool threads. */
+        double cpu;
+        /** Message of the first exception thrown by a worker, if any. */
+        string error;
+        /** Set once the calling thread is done. Tasks that start afterwards
+         * must not touch the job any more, since features and cloud belong
+         * to the caller. */
+        bool closed;
+        /** Number of pool threads currently working on the job. */
+        int active;
+        /** Signalled whenever a pool thread is done with the job. */
+        boost::condition_variable finished;
+
+    };
+
+    void Clutsegmenter::refineWorker(RefineJob & job) {
+        while (true) {
+            size_t i;
+            {
+                boost::mutex::scoped_lock lock(job.mutex);
+                // In multi-object mode, skip the choices of templates for
+                // which a higher-ranked choice has already been accepted.
+                while (job.multi_object && job.next < job.accepted && job.found.count(job.name(job.next)) > 0) {
+                    job.next++;
+                }
+                // Stop if there are no choices left, if the remaining
+                // choices are ranked lower than an accepted one, or if
+                // another worker has failed.
+                if (job.next >= job.accepted || !job.error.empty()) {
+                    return;
+                }
+                i = job.next++;
+            }
+            bool passed;
+            try {
+                passed = tryChoice(job.features, job.cloud, job.detect_choices[i],
+                                    job.refine_choices[i], job.matches[i], job.stats[i]);
+            } catch (const exception & e) {
+                boost::mutex::scoped_lock lock(job.mutex);
+                if (job.error.empty()) {
+                    job.error = e.what();
+                }
+                return;
+            } catch (...) {
+                boost::mutex::scoped_lock lock(job.mutex);
+                if (job.error.empty()) {
+                    job.error = "unknown exception";
+                }
+                return;
+            }
+            if (passed) {
+                boost::mutex::scoped_lock lock(job.mutex);
+                job.passed[i] = true;
+                if (job.multi_object) {
+                    job.found.insert(job.name(i));
+                } else {
+                    job.accepted = min(job.accepted, i);
                 }
             }
         }
     }
 
+    void Clutsegmenter::refineTask(Clutsegmenter * sgm, const boost::shared_ptr<RefineJob> & job) {
+        {
+            boost::mutex::scoped_lock lock(job->mutex);
+            // The caller may have returned already, together with sgm
+            if (job->closed) {
+                return;
+            }
+            job->active++;
+        }
+        Stopwatch watch;
+        sgm->refineWorker(*job);
+        boost::mutex::scoped_lock lock(job->mutex);
+        job->cpu += watch.cpu();
+        job->active--;
+        job->finished.notify_all();
+    }
+
+    void Clutsegmenter::refineParallel(const Features2d & queryF2d,
+                                        const PointCloudT & queryCloud,
+                                        const vector<pair<int, int> > & ds,
+                                        Result & result,
+                                        ClutsegmenterStats & stats) {
+        // Build missing refinement models up-front, such that the workers
+        // only read from the cache.
+        BOOST_FOREACH(const Guess & g, result.detect_choices) {
+            getRefineModel(g.getObject()->name);
+        }
+
+        // The threads of the pool are shared by all queries in flight, e.g.
+        // in recognizeBatch. The calling thread refines as well, and does
+        // not wait for tasks that have not been started by the time it runs
+        // out of choices, so a busy pool only means less parallelism.
+        boost::shared_ptr<RefineJob> shared(new RefineJob(queryF2d, queryCloud, result.detect_choices, multi_object_));
+        RefineJob & job = *shared;
+        size_t n = min(size_t(refine_threads_), result.detect_choices.size());
+        for (size_t t = 1; t < n; t++) {
+            refine_pool_->submit(boost::bind(&Clutsegmenter::refineTask, this, shared));
+        }
+        refineWorker(job);
+        {
+            boost::mutex::scoped_lock lock(job.mutex);
+            job.closed = true;
+            while (job.active > 0) {
+                job.finished.wait(lock);
+            }
+        }
+        if (!job.error.empty()) {
+            throw runtime_error("Refinement failed: " + job.error);
+        }
+        // The processor time of the calling thread is accounted for
+        // already, but not the one of the pool threads.
+        stats.recognize_latency.acc_cpu += job.cpu;
+
+        if (multi_object_) {
+            // Replay what sequential refinement would have done. A choice
+            // that has been skipped by the workers has a higher-ranked
+            // accepted choice of the same template, so it is skipped here
+            // as well.
+            set<string> found;
+            result.refine_choices.reserve(result.detect_choices.size());
+            for (size_t i = 0; i < result.detect_choices.size(); i++) {
+                if (found.count(job.name(i)) == 0) {
+                    stats += job.stats[i];
+                    if (job.passed[i]) {
+                        acceptChoice(result, i, job.refine_choices[i], ds, job.matches[i], stats);
+                        found.insert(job.name(i));
+                    }
+                }
+            }
+            return;
+        }
+
+        // Workers take the choices in the order of their rank, hence every
+        // choice ranked higher than the accepted one has been refined and
+        // rejected. This is exactly what sequential refinement would have
+        // done, so the results of the choices ranked lower than the accepted
+        // one are discarded, including their statistics.
+        size_t last = min(job.accepted, result.detect_choices.size() - 1);
+        for (size_t i = 0; i <= last; i++) {
+            stats += job.stats[i];
+        }
+        if (job.accepted < result.detect_choices.size()) {
+            acceptChoice(result, job.accepted, job.refine_choices[job.accepted], ds, job.matches[job.accepted], stats);
+        }
+    }
+
     int sum_matches(Ptr<Matcher> & matcher) {
         vector<pair<int, int> > labelSizes;
         matcher->getLabelSizes(labelSizes);
@@ -233,86 +938,100 @@ namespace clutseg {
         return total;
     }
 
-    bool Clutsegmenter::detect(Features2d & queryF2d, vector<Guess> & detect_choices, vector<pair<int, int> > & matches) {
-        Ptr<FeatureExtractor> extractor = FeatureExtractor::create(detect_params_.feParams);
-        extractor->detectAndExtract(queryF2d);
+    bool Clutsegmenter::detect(Features2d & queryF2d, vector<Guess> & detect_choices, vector<pair<int, int> > & matches, ClutsegmenterStats & stats) {
+        Stopwatch watch;
+        Ptr<ExtractorPool> extractors = getExtractors();
+        {
+            ExtractorPool::Lease extractor(*extractors);
+            extractor->detectAndExtract(queryF2d);
+        }
+        stats.extract_latency.add(watch);
 
-        Ptr<Matcher> detectMatcher = Matcher::create(detect_params_.matcherParams);
-        detectMatcher->add(base_);
+        Ptr<MatcherPool> matchers = getDetectMatchers();
+        MatcherPool::Lease detectMatcher(*matchers);
 
-        Ptr<Recognizer> recognizer = new KinectRecognizer(&base_, detectMatcher,
+        Ptr<Recognizer> recognizer = new KinectRecognizer(base_, *detectMatcher,
                             &detect_params_.guessParams, 0,
                              baseDirectory_);
 
+        watch.restart();
         recognizer->match(queryF2d, detect_choices);
         detectMatcher->getLabelSizes(matches);
+        stats.detect_latency.add(watch);
 
         { /* begin statistics */
-            stats_.acc_keypoints += queryF2d.keypoints.size();
-            stats_.acc_detect_matches += sum_matches(detectMatcher);
-            stats_.acc_detect_guesses += detect_choices.size();
+            stats.acc_keypoints += queryF2d.keypoints.size();
+            stats.acc_detect_matches += sum_matches(*detectMatcher);
+            stats.acc_detect_guesses += detect_choices.size();
             BOOST_FOREACH(const Guess & g, detect_choices) {
-                stats_.acc_detect_inliers += g.inliers.size();
+                stats.acc_detect_inliers += g.inliers.size();
             }
         } /* end statistics */
 
         return detect_choices.empty();
     }
 
-    bool Clutsegmenter::refine(const Features2d & queryF2d, const PointCloudT & queryCloud, Guess & refineChoice, vector<pair<int, int> > & matches) {
+    bool Clutsegmenter::refine(const Features2d & queryF2d, const PointCloudT & queryCloud, const Guess & detectChoice, Guess & refineChoice, vector<pair<int, int> > & matches, ClutsegmenterStats & stats) {
         if (refine_params_.matcherParams.doRatioTest) {
             cerr << "[WARNING] RatioTest enabled for locating object" << endl;
         }
-        vector<Ptr<TexturedObject> > so;
-        BOOST_FOREACH(const Ptr<TexturedObject> & obj, objects_) {
-            if (obj->name == refineChoice.getObject()->name) {
-                // Create a new textured object instance --- those thingies
-                // cannot exist in multiple training bases, this breaks indices
-                // that are tightly coupled between TrainingBase and
-                // TexturedObject instances.
-                Ptr<TexturedObject> newObj = new TexturedObject();
-                newObj->id = 0;
-                newObj->name = obj->name;
-                newObj->directory_ = obj->directory_;
-                newObj->stddev = obj->stddev;
-                newObj->observations = obj->observations;
-                so.push_back(newObj);
-                break;
-            }
-        }
-        TrainingBase single(so);
-
-        Ptr<Matcher> refineMatcher = Matcher::create(refine_params_.matcherParams);
-        refineMatcher->add(single);
+        RefineModel model = getRefineModel(detectChoice.getObject()->name);
+        MatcherPool::Lease refineMatcher(*model.matchers);
 
-        Ptr<Recognizer> recognizer = new KinectRecognizer(&single, refineMatcher,
+        Ptr<Recognizer> recognizer = new KinectRecognizer(model.base, *refineMatcher,
                             &refine_params_.guessParams, 0,
                              baseDirectory_);
 
         vector<Guess> guesses;
         recognizer->match(queryF2d, guesses); 
         refineMatcher->getLabelSizes(matches);
+        int refine_matches = sum_matches(*refineMatcher);
 
-        cout << "[CLUTSEG] refine_matches: " << sum_matches(refineMatcher) << endl;
-        stats_.acc_refine_matches += sum_matches(refineMatcher);
-        stats_.acc_refine_guesses += guesses.size();
+        cout << "[CLUTSEG] refine_matches: " << refine_matches << endl;
+        stats.acc_refine_matches += refine_matches;
+        stats.acc_refine_guesses += guesses.size();
         BOOST_FOREACH(const Guess & g, guesses) {
-            stats_.acc_refine_inliers += g.inliers.size();
+            stats.acc_refine_inliers += g.inliers.size();
         }
 
         if (guesses.empty()) {
             cerr << "[WARNING] No guess made in refinement!" << endl;
             return false;
         } else {
-            BOOST_FOREACH(Guess & guess, guesses) {
-                mapInliersToCloud(guess.inlierCloud, guess, queryF2d.image, queryCloud);
+            if (ranking_->needsInlierCloud()) {
+                BOOST_FOREACH(Guess & guess, guesses) {
+                    mapInliersToCloud(guess.inlierCloud, guess, queryF2d.image, queryCloud, map_neighbourhood_);
+                }
             }
-            sort(guesses.begin(), guesses.end(), GuessComparator(ranking_));
-            refineChoice = guesses[0]; 
+            moveGuess(guesses[bestGuess(guesses, *ranking_)], refineChoice);
             return true;
         }
     }
 
+    ClutsegmenterStats & ClutsegmenterStats::operator+=(const ClutsegmenterStats & rhs) {
+        queries += rhs.queries;
+        acc_keypoints += rhs.acc_keypoints;
+        acc_detect_matches += rhs.acc_detect_matches;
+        acc_detect_guesses += rhs.acc_detect_guesses;
+        acc_detect_inliers += rhs.acc_detect_inliers;
+        acc_detect_choice_matches += rhs.acc_detect_choice_matches;
+        acc_detect_choice_inliers += rhs.acc_detect_choice_inliers;
+        acc_refine_matches += rhs.acc_refine_matches;
+        acc_refine_inliers += rhs.acc_refine_inliers;
+        acc_refine_guesses += rhs.acc_refine_guesses;
+        acc_refine_choice_matches += rhs.acc_refine_choice_matches;
+        acc_refine_choice_inliers += rhs.acc_refine_choice_inliers;
+        choices += rhs.choices;
+        rejected_choices += rhs.rejected_choices;
+        extract_latency += rhs.extract_latency;
+        detect_latency += rhs.detect_latency;
+        map_latency += rhs.map_latency;
+        rank_latency += rhs.rank_latency;
+        refine_latency += rhs.refine_latency;
+        recognize_latency += rhs.recognize_latency;
+        return *this;
+    }
+
     void ClutsegmenterStats::populateResponse(Response & r) const {
         r.avg_keypoints = float(acc_keypoints) / queries;
         r.avg_detect_guesses = float(acc_detect_guesses) / queries;
@@ -325,6 +1044,21 @@ namespace clutseg {
         r.avg_refine_inliers = float(acc_refine_inliers) / acc_refine_guesses;
         r.avg_refine_choice_matches = float(acc_refine_choice_matches) / choices;
         r.avg_refine_choice_inliers = float(acc_refine_choice_inliers) / choices;
+        r.avg_extract_wall = extract_latency.avgWall();
+        r.p95_extract_wall = extract_latency.wallPercentile(0.95);
+        r.avg_extract_cpu = extract_latency.avgCpu();
+        r.avg_detect_wall = detect_latency.avgWall();
+        r.p95_detect_wall = detect_latency.wallPercentile(0.95);
+        r.avg_detect_cpu = detect_latency.avgCpu();
+        r.avg_map_wall = map_latency.avgWall();
+        r.p95_map_wall = map_latency.wallPercentile(0.95);
+        r.avg_map_cpu = map_latency.avgCpu();
+        r.avg_rank_wall = rank_latency.avgWall();
+        r.p95_rank_wall = rank_latency.wallPercentile(0.95);
+        r.avg_rank_cpu = rank_latency.avgCpu();
+        r.avg_refine_wall = refine_latency.avgWall();
+        r.p95_refine_wall = refine_latency.wallPercentile(0.95);
+        r.avg_refine_cpu = refine_latency.avgCpu();
     }
 
 }
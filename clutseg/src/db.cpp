@@ -21,6 +21,7 @@ namespace clutseg {
         if (sqlite3_open(path.string().c_str(), &db) != SQLITE_OK) {
             throw ios_base::failure("Error when opening database: " + string(sqlite3_errmsg(db)));
         }
+        sqlite3_busy_timeout(db, 60000);
     }
     
     void db_exec(sqlite3 *&db, const string & sql) {
@@ -0,0 +1,288 @@
+/*
+ * Author: Julius Adorf
+ */
+
+#include "clutseg/loader.h"
+
+#include "clutseg/check.h"
+#include "clutseg/runner.h"
+
+#include "clutseg/gcc_diagnostic_disable.h"
+    #include <boost/bind.hpp>
+    #include <boost/format.hpp>
+    #include <iostream>
+    #include <opencv2/highgui/highgui.hpp>
+    #include <pcl/io/pcd_io.h>
+    #include <stdexcept>
+#include "clutseg/gcc_diagnostic_enable.h"
+
+using namespace cv;
+using namespace opencv_candidate;
+using namespace std;
+
+namespace bfs = boost::filesystem;
+
+namespace clutseg {
+
+    /** \brief Returns the memory taken by the image and cloud of a scene. */
+    static size_t sceneBytes(const Query & query) {
+        return query.img.total() * query.img.elemSize()
+                + query.cloud->points.size() * sizeof(pcl::PointXYZ);
+    }
+
+    SceneLoader::SceneLoader(const bfs::path & dir,
+                             const vector<string> & img_names,
+                             size_t budget_bytes) :
+                                dir_(dir), img_names_(img_names),
+                                budget_bytes_(budget_bytes),
+                                ready_bytes_(0), taken_(0), stop_(false) {
+        // Start the thread only after all members have been initialized
+        thread_ = boost::thread(boost::bind(&SceneLoader::load, this));
+    }
+
+    SceneLoader::~SceneLoader() {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        thread_.join();
+    }
+
+    void SceneLoader::load() {
+        for (size_t i = 0; i < img_names_.size(); i++) {
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+                while (!stop_ && !ready_.empty() && ready_bytes_ >= budget_bytes_) {
+                    cond_.wait(lock);
+                }
+                if (stop_) {
+                    return;
+                }
+            }
+
+            Scene scene;
+            scene.img_name = img_names_[i];
+            bfs::path img_path = dir_ / scene.img_name;
+            Mat img;
+            PointCloudT::Ptr cloud(new PointCloudT());
+            // Errors are handed to the caller of next, an exception must not
+            // escape this thread.
+            try {
+                img = imread(img_path.string());
+                if (img.empty()) {
+                    scene.error = str(boost::format(
+                        "ERROR: Cannot read image '%s'. Please check\n"
+                        "whether image file exists. Full path is '%s'."
+                    ) % scene.img_name % img_path);
+                } else {
+                    bfs::path cloud_path = cloudPath(img_path);
+                    if (bfs::exists(cloud_path) && pcl::io::loadPCDFile(cloud_path.string(), *cloud) < 0) {
+                        scene.error = str(boost::format("ERROR: Cannot read cloud '%s'.") % cloud_path);
+                    }
+                }
+            } catch (const exception & e) {
+                scene.error = str(boost::format("ERROR: Cannot load scene '%s': %s") % scene.img_name % e.what());
+            } catch (...) {
+                scene.error = str(boost::format("ERROR: Cannot load scene '%s': unknown exception") % scene.img_name);
+            }
+            scene.query = Query(img, cloud);
+            scene.bytes = sceneBytes(scene.query);
+
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+                ready_bytes_ += scene.bytes;
+                ready_.push_back(scene);
+            }
+            cond_.notify_all();
+            if (!scene.error.empty()) {
+                return;
+            }
+        }
+    }
+
+    bool SceneLoader::next(string & img_name, Query & query) {
+        Scene scene;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            if (taken_ == img_names_.size()) {
+                return false;
+            }
+            while (ready_.empty()) {
+                cond_.wait(lock);
+            }
+            // Nothing is loaded after a failure, and the failure is kept
+            // for subsequent calls
+            if (!ready_.front().error.empty()) {
+                throw runtime_error(ready_.front().error);
+            }
+            scene = ready_.front();
+            ready_.pop_front();
+            ready_bytes_ -= scene.bytes;
+            taken_++;
+        }
+        cond_.notify_all();
+        img_name = scene.img_name;
+        query = scene.query;
+        return true;
+    }
+
+    /** \brief Returns a copy of a test set without its scenes. */
+    static boost::shared_ptr<TestSet> withoutScenes(const TestSet & test_set) {
+        boost::shared_ptr<TestSet> copy(new TestSet());
+        copy->dir = test_set.dir;
+        copy->ground_truth = test_set.ground_truth;
+        copy->camera = test_set.camera;
+        return copy;
+    }
+
+    TestSetCache::TestSetCache(size_t budget_bytes) :
+                                budget_bytes_(budget_bytes), used_bytes_(0),
+                                clock_(0), decoding_(0), stop_(false) {}
+
+    TestSetCache::~TestSetCache() {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            stop_ = true;
+        }
+        decoders_.join_all();
+    }
+
+    size_t TestSetCache::getBudgetBytes() const {
+        return budget_bytes_;
+    }
+
+    boost::shared_ptr<const TestSet> TestSetCache::get(const bfs::path & dir) {
+        Ptr<Entry> entry;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            Ptr<Entry> & e = entries_[dir.string()];
+            if (e.empty()) {
+                e = new Entry();
+            }
+            entry = e;
+            entry->last_used = ++clock_;
+        }
+        {
+            // Other test sets can be looked up while this one is read
+            boost::mutex::scoped_lock read_lock(entry->mutex);
+            bool read;
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+                read = entry->test_set.get() != 0;
+            }
+            if (!read) {
+                boost::shared_ptr<TestSet> test_set(new TestSet());
+                test_set->dir = dir;
+                test_set->ground_truth = loadGroundTruth(dir / "ground-truth.txt");
+                bfs::path camera_path = dir / "camera.yml";
+                assert_path_exists(camera_path);
+                test_set->camera = Camera(camera_path.string(), Camera::TOD_YAML);
+                boost::mutex::scoped_lock lock(mutex_);
+                entry->test_set = test_set;
+            }
+        }
+        boost::mutex::scoped_lock lock(mutex_);
+        if (entry->state == NOT_CACHED && !stop_) {
+            entry->state = DECODING;
+            decoding_++;
+            decoders_.create_thread(boost::bind(&TestSetCache::decode, this, entry));
+        }
+        return entry->test_set;
+    }
+
+    void TestSetCache::waitUntilDecoded() {
+        boost::mutex::scoped_lock lock(mutex_);
+        while (decoding_ > 0) {
+            decoded_.wait(lock);
+        }
+    }
+
+    void TestSetCache::decode(Ptr<Entry> entry) {
+        boost::shared_ptr<TestSet> test_set;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            test_set = withoutScenes(*entry->test_set);
+        }
+        vector<string> img_names;
+        for (GroundTruth::const_iterator it = test_set->ground_truth.begin();
+                it != test_set->ground_truth.end(); it++) {
+            img_names.push_back(it->first);
+        }
+        size_t bytes = 0;
+        bool fits = true;
+        bool stopped = false;
+        try {
+            // The scenes are taken right away, so the loader needs no more
+            // than a few scenes of memory
+            SceneLoader loader(test_set->dir, img_names, 64 << 20);
+            string img_name;
+            Query query;
+            while (fits && loader.next(img_name, query)) {
+                {
+                    boost::mutex::scoped_lock lock(mutex_);
+                    stopped = stop_;
+                }
+                if (stopped) {
+                    break;
+                }
+                size_t scene_bytes = sceneBytes(query);
+                bytes += scene_bytes;
+                // The scenes of a test set are taken by the same sensor, so
+                // they all take about as much memory as the first one. Give
+                // up right away rather than decoding up to the budget in
+                // vain.
+                fits = bytes <= budget_bytes_ && (!test_set->scenes.empty() || scene_bytes * img_names.size() <= budget_bytes_);
+                if (fits) {
+                    test_set->scenes[img_name] = query;
+                }
+            }
+        } catch (const exception & e) {
+            // Experiments on this test set will report the error when they
+            // load the scenes themselves
+            cerr << "[RUN] ERROR, cannot decode test scenes of " << test_set->dir << ": " << e.what() << endl;
+            fits = false;
+        }
+
+        boost::mutex::scoped_lock lock(mutex_);
+        if (stopped) {
+            entry->state = NOT_CACHED;
+        } else if (fits && makeRoom(bytes, static_cast<Entry *>(entry))) {
+            entry->test_set = test_set;
+            entry->bytes = bytes;
+            entry->state = CACHED;
+            used_bytes_ += bytes;
+            cout << "[RUN] Cached " << img_names.size() << " test scenes of " << test_set->dir << endl;
+        } else {
+            // Not decoded again on the next request
+            entry->state = UNCACHEABLE;
+            cout << "[RUN] Test scenes of " << test_set->dir << " do not fit into the cache" << endl;
+        }
+        decoding_--;
+        decoded_.notify_all();
+    }
+
+    bool TestSetCache::makeRoom(size_t bytes, const Entry * keep) {
+        while (used_bytes_ + bytes > budget_bytes_) {
+            Ptr<Entry> lru;
+            for (map<string, Ptr<Entry> >::iterator it = entries_.begin(); it != entries_.end(); it++) {
+                Ptr<Entry> & e = it->second;
+                if (e->state == CACHED && static_cast<Entry *>(e) != keep && (lru.empty() || e->last_used < lru->last_used)) {
+                    lru = e;
+                }
+            }
+            if (lru.empty()) {
+                return false;
+            }
+            // Experiments that still use the scenes keep them alive
+            // until they are done
+            cout << "[RUN] Evicting test scenes of " << lru->test_set->dir << " from the cache" << endl;
+            lru->test_set = withoutScenes(*lru->test_set);
+            used_bytes_ -= lru->bytes;
+            lru->bytes = 0;
+            lru->state = NOT_CACHED;
+        }
+        return true;
+    }
+
+}
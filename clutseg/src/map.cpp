@@ -6,7 +6,9 @@
 
 #include "clutseg/gcc_diagnostic_disable.h"
 #include <cv.h>
+#include <algorithm>
 #include <boost/foreach.hpp>
+#include <limits>
 #include "clutseg/gcc_diagnostic_enable.h"
 
 using namespace cv;
@@ -15,8 +17,27 @@ using namespace pcl;
 
 namespace clutseg {
 
-    void mapToCloud(PointCloudT & keypoints3d, const vector<Point> keypoints2d,
-                    const Mat & scene2d, const PointCloudT & scene3d) {
+    /** \brief Looks for the valid point closest to pixel (u, v) in a window
+     * of the given radius around it. Returns NaN if there is none. */
+    static PointXYZ nearestValid(const PointCloudT & scene3d, int u, int v, int radius) {
+        const int w = scene3d.width;
+        const int h = scene3d.height;
+        int best = -1;
+        int best_d = numeric_limits<int>::max();
+        for (int y = max(0, v - radius); y <= min(h - 1, v + radius); y++) {
+            for (int x = max(0, u - radius); x <= min(w - 1, u + radius); x++) {
+                int d = (x - u) * (x - u) + (y - v) * (y - v);
+                if (d < best_d && scene3d.points[y * w + x].z == scene3d.points[y * w + x].z) {
+                    best = y * w + x;
+                    best_d = d;
+                }
+            }
+        }
+        return best < 0 ? PointXYZ(NAN, NAN, NAN) : scene3d.points[best];
+    }
+
+    void mapToCloud(PointCloudT & keypoints3d, const vector<Point> & keypoints2d,
+                    const Mat & scene2d, const PointCloudT & scene3d, int neighbourhood) {
         // See also tod::PCLToPoints, line 117 of clouds.h in tod:training. I wanted a method
         // that can be tested with different parameters, since I am not sure how to interprete
         // cloud.width and cloud.height. Tests (see test_map.cpp) show that scaling with the
@@ -24,24 +45,51 @@ namespace clutseg {
         // factor for y-indices.
         float scaleW = float(scene3d.width) / scene2d.cols;
         float scaleH = scaleW;
-        BOOST_FOREACH(Point p, keypoints2d) {
-            size_t u = size_t(p.x * scaleW);
-            size_t v = size_t(p.y * scaleH);
-            if (u < scene3d.width && v < scene3d.height) {
-                keypoints3d.push_back(scene3d(u, v));
-            } else {
+        const int w = scene3d.width;
+        const int h = scene3d.height;
+        const size_t n = keypoints2d.size();
+
+        // Compute all indices into the organized cloud first. This loop has
+        // no branches and no dependencies between iterations, such that the
+        // compiler can vectorize it. -1 marks points outside of the cloud.
+        vector<int> idx(n);
+        for (size_t i = 0; i < n; i++) {
+            float fu = keypoints2d[i].x * scaleW;
+            float fv = keypoints2d[i].y * scaleH;
+            int u = int(fu);
+            int v = int(fv);
+            bool inside = fu >= 0 && fv >= 0 && u < w && v < h;
+            idx[i] = inside ? v * w + u : -1;
+        }
+
+        // Gather the points. If the exact pixel has no depth, optionally
+        // fall back to the closest valid point in the neighbourhood. The
+        // window is centred on the pixel, hence an even neighbourhood k
+        // yields the same (k+1)x(k+1) window as k+1.
+        const int radius = neighbourhood / 2;
+        keypoints3d.points.reserve(keypoints3d.points.size() + n);
+        for (size_t i = 0; i < n; i++) {
+            if (idx[i] < 0) {
                 keypoints3d.push_back(PointXYZ(NAN, NAN, NAN));
+            } else {
+                const PointXYZ & p = scene3d.points[idx[i]];
+                if (radius > 0 && p.z != p.z) {
+                    keypoints3d.push_back(nearestValid(scene3d, idx[i] % w, idx[i] / w, radius));
+                } else {
+                    keypoints3d.push_back(p);
+                }
             }
         }
     }
 
     void mapInliersToCloud(PointCloudT & keypoints3d, const tod::Guess & guess,
-                    const Mat & scene2d, const PointCloudT & scene3d) {
+                    const Mat & scene2d, const PointCloudT & scene3d, int neighbourhood) {
         vector<Point> inliers;
+        inliers.reserve(guess.inliers.size());
         BOOST_FOREACH(int idx, guess.inliers) {
             inliers.push_back(guess.image_points_[idx]);
         }
-        mapToCloud(keypoints3d, inliers, scene2d, scene3d);
+        mapToCloud(keypoints3d, inliers, scene2d, scene3d, neighbourhood);
     }   
 
 }
@@ -11,8 +11,10 @@
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
 #include <ctime>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <set>
 
 using namespace std;
 using namespace tod;
@@ -35,15 +37,21 @@ namespace clutseg {
         MemberMap m;
         setMemberField(m, "accept_threshold", accept_threshold);
         setMemberField(m, "ranking", ranking);
+        setMemberField(m, "min_inliers", min_inliers);
+        setMemberField(m, "min_depth_ratio", min_depth_ratio);
+        setMemberField(m, "max_extent", max_extent);
         insertOrUpdate(db, "pms_clutseg", m, id);
     }
 
     void ClutsegParams::deserialize(sqlite3* db) {
         sqlite3_stmt *read;
-        db_prepare(db, read, boost::format("select accept_threshold, ranking from pms_clutseg where id=%d;") % id);
+        db_prepare(db, read, boost::format("select accept_threshold, ranking, min_inliers, min_depth_ratio, max_extent from pms_clutseg where id=%d;") % id);
         db_step(read, SQLITE_ROW);
         accept_threshold = sqlite3_column_double(read, 0);
         ranking = string((const char*) sqlite3_column_text(read, 1));
+        min_inliers = sqlite3_column_int(read, 2);
+        min_depth_ratio = sqlite3_column_double(read, 3);
+        max_extent = sqlite3_column_double(read, 4);
         sqlite3_finalize(read);
     }
      
@@ -91,6 +99,12 @@ namespace clutseg {
         insertOrUpdate(db, "pms_fe", m, id);
     }
 
+    bool equal_pms_fe(const FeatureExtractionParams & a, const FeatureExtractionParams & b) {
+        return a.detector_type == b.detector_type && a.extractor_type == b.extractor_type &&
+            a.descriptor_type == b.descriptor_type && a.detector_params == b.detector_params &&
+            a.extractor_params == b.extractor_params;
+    }
+
     void deserialize_pms_match(sqlite3* db, MatcherParameters & pms_match, int64_t & id) {
         sqlite3_stmt *read;
         db_prepare(db, read, boost::format(
@@ -114,6 +128,11 @@ namespace clutseg {
         insertOrUpdate(db, "pms_match", m, id);
     }
 
+    bool equal_pms_match(const MatcherParameters & a, const MatcherParameters & b) {
+        return a.type == b.type && a.knn == b.knn &&
+            a.doRatioTest == b.doRatioTest && a.ratioThreshold == b.ratioThreshold;
+    }
+
     void deserialize_pms_guess(sqlite3* db, GuessGeneratorParameters & pms_guess, int64_t & id) {
         sqlite3_stmt *read;
         db_prepare(db, read, boost::format(
@@ -244,8 +263,24 @@ namespace clutseg {
         setMemberField(m, "avg_refine_inliers", avg_refine_inliers);
         setMemberField(m, "avg_refine_choice_matches", avg_refine_choice_matches);
         setMemberField(m, "avg_refine_choice_inliers", avg_refine_choice_inliers);
+        setMemberField(m, "avg_extract_wall", avg_extract_wall);
+        setMemberField(m, "p95_extract_wall", p95_extract_wall);
+        setMemberField(m, "avg_extract_cpu", avg_extract_cpu);
+        setMemberField(m, "avg_detect_wall", avg_detect_wall);
+        setMemberField(m, "p95_detect_wall", p95_detect_wall);
+        setMemberField(m, "avg_detect_cpu", avg_detect_cpu);
+        setMemberField(m, "avg_map_wall", avg_map_wall);
+        setMemberField(m, "p95_map_wall", p95_map_wall);
+        setMemberField(m, "avg_map_cpu", avg_map_cpu);
+        setMemberField(m, "avg_rank_wall", avg_rank_wall);
+        setMemberField(m, "p95_rank_wall", p95_rank_wall);
+        setMemberField(m, "avg_rank_cpu", avg_rank_cpu);
+        setMemberField(m, "avg_refine_wall", avg_refine_wall);
+        setMemberField(m, "p95_refine_wall", p95_refine_wall);
+        setMemberField(m, "avg_refine_cpu", avg_refine_cpu);
         setMemberField(m, "train_runtime", train_runtime);
         setMemberField(m, "test_runtime", test_runtime);
+        setMemberField(m, "test_stage_cpu", test_stage_cpu);
         insertOrUpdate(db, "response", m, id);
     }
 
@@ -285,8 +320,24 @@ namespace clutseg {
             "avg_refine_inliers, "
             "avg_refine_choice_matches, "
             "avg_refine_choice_inliers, "
+            "avg_extract_wall, "
+            "p95_extract_wall, "
+            "avg_extract_cpu, "
+            "avg_detect_wall, "
+            "p95_detect_wall, "
+            "avg_detect_cpu, "
+            "avg_map_wall, "
+            "p95_map_wall, "
+            "avg_map_cpu, "
+            "avg_rank_wall, "
+            "p95_rank_wall, "
+            "avg_rank_cpu, "
+            "avg_refine_wall, "
+            "p95_refine_wall, "
+            "avg_refine_cpu, "
             "train_runtime, "
-            "test_runtime "
+            "test_runtime, "
+            "test_stage_cpu "
             "from response where id=%d;") % id);
         db_step(read, SQLITE_ROW);
         int c = 0;
@@ -323,8 +374,24 @@ namespace clutseg {
         avg_refine_inliers = sqlite3_column_double(read, c++);
         avg_refine_choice_matches = sqlite3_column_double(read, c++);
         avg_refine_choice_inliers = sqlite3_column_double(read, c++);
+        avg_extract_wall = sqlite3_column_double(read, c++);
+        p95_extract_wall = sqlite3_column_double(read, c++);
+        avg_extract_cpu = sqlite3_column_double(read, c++);
+        avg_detect_wall = sqlite3_column_double(read, c++);
+        p95_detect_wall = sqlite3_column_double(read, c++);
+        avg_detect_cpu = sqlite3_column_double(read, c++);
+        avg_map_wall = sqlite3_column_double(read, c++);
+        p95_map_wall = sqlite3_column_double(read, c++);
+        avg_map_cpu = sqlite3_column_double(read, c++);
+        avg_rank_wall = sqlite3_column_double(read, c++);
+        p95_rank_wall = sqlite3_column_double(read, c++);
+        avg_rank_cpu = sqlite3_column_double(read, c++);
+        avg_refine_wall = sqlite3_column_double(read, c++);
+        p95_refine_wall = sqlite3_column_double(read, c++);
+        avg_refine_cpu = sqlite3_column_double(read, c++);
         train_runtime = sqlite3_column_double(read, c++);
         test_runtime = sqlite3_column_double(read, c++);
+        test_stage_cpu = sqlite3_column_double(read, c++);
         sqlite3_finalize(read);
     }
 
@@ -528,7 +595,8 @@ namespace clutseg {
 
    void selectExperimentsNotRun(sqlite3* & db, vector<Experiment> & exps) {
         sqlite3_stmt *select;
-        string sql = "select id from experiment where response_id is null order by id asc;";
+        string sql = "select id from experiment where response_id is null "
+            "and (claimed_by is null or lease_expires < datetime('now')) order by id asc;";
         db_prepare(db, select, sql);
         // TODO: clear interface for logging sql statements, is there any hook in sqlite3?
         cout << "[SQL] " << sql << endl;
@@ -545,6 +613,165 @@ namespace clutseg {
         sqlite3_finalize(select);
     }
 
+    int countExperimentsToRun(sqlite3* & db) {
+        sqlite3_stmt *select;
+        db_prepare(db, select, "select count(*) from experiment where response_id is null and skip = 0 "
+            "and (claimed_by is null or lease_expires < datetime('now'));");
+        int n;
+        try {
+            db_step(select, SQLITE_ROW);
+            n = sqlite3_column_int(select, 0);
+        } catch (...) {
+            sqlite3_finalize(select);
+            throw;
+        }
+        sqlite3_finalize(select);
+        return n;
+    }
+
+    /** \brief Prepares a statement that refers to a runner as ?1. The
+     * runner is bound rather than formatted into the statement, since host
+     * names are not under our control. */
+    static void prepareForRunner(sqlite3* & db, sqlite3_stmt* & stmt,
+                                    const boost::format & sql, const string & runner) {
+        db_prepare(db, stmt, sql);
+        if (sqlite3_bind_text(stmt, 1, runner.c_str(), runner.size(), SQLITE_TRANSIENT) != SQLITE_OK) {
+            string e(sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            throw ios_base::failure("Error when binding runner: " + e);
+        }
+    }
+
+    /** \brief Executes a statement that refers to a runner as ?1, see
+     * prepareForRunner. Returns the number of rows changed. */
+    static int execForRunner(sqlite3* & db, const boost::format & sql, const string & runner) {
+        sqlite3_stmt *stmt;
+        prepareForRunner(db, stmt, sql, runner);
+        try {
+            db_step(stmt, SQLITE_DONE);
+        } catch (...) {
+            sqlite3_finalize(stmt);
+            throw;
+        }
+        sqlite3_finalize(stmt);
+        return sqlite3_changes(db);
+    }
+
+    bool claimExperiment(sqlite3* & db, int64_t id, const string & runner, int lease_seconds) {
+        return execForRunner(db, boost::format(
+            "update experiment set claimed_by=?1, lease_expires=datetime('now', '%+d seconds') "
+            "where id=%d and response_id is null "
+            "and (claimed_by is null or claimed_by=?1 or lease_expires < datetime('now'));")
+                % lease_seconds % id, runner) == 1;
+    }
+
+    bool holdsClaim(sqlite3* & db, int64_t id, const string & runner) {
+        sqlite3_stmt *select;
+        prepareForRunner(db, select, boost::format(
+            "select count(*) from experiment where id=%d and claimed_by=?1;") % id, runner);
+        bool holds;
+        try {
+            db_step(select, SQLITE_ROW);
+            holds = sqlite3_column_int(select, 0) > 0;
+        } catch (...) {
+            sqlite3_finalize(select);
+            throw;
+        }
+        sqlite3_finalize(select);
+        return holds;
+    }
+
+    void renewClaims(sqlite3* & db, const string & runner, int lease_seconds) {
+        execForRunner(db, boost::format(
+            "update experiment set lease_expires=datetime('now', '%+d seconds') "
+            "where claimed_by=?1 and response_id is null;") % lease_seconds, runner);
+    }
+
+    void releaseClaims(sqlite3* & db, const string & runner) {
+        execForRunner(db, boost::format(
+            "update experiment set claimed_by=null, lease_expires=null "
+            "where claimed_by=?1 and response_id is null;"), runner);
+    }
+
+    /** \brief A column that has been added to the schema after databases
+     * have been created with it, see upgradeSchema. */
+    struct AddedColumn {
+        const char *table;
+        const char *column;
+        const char *definition;
+    };
+
+    static const AddedColumn ADDED_COLUMNS[] = {
+        { "response", "avg_extract_wall", "float not null default 0" },
+        { "response", "p95_extract_wall", "float not null default 0" },
+        { "response", "avg_extract_cpu", "float not null default 0" },
+        { "response", "avg_detect_wall", "float not null default 0" },
+        { "response", "p95_detect_wall", "float not null default 0" },
+        { "response", "avg_detect_cpu", "float not null default 0" },
+        { "response", "avg_map_wall", "float not null default 0" },
+        { "response", "p95_map_wall", "float not null default 0" },
+        { "response", "avg_map_cpu", "float not null default 0" },
+        { "response", "avg_rank_wall", "float not null default 0" },
+        { "response", "p95_rank_wall", "float not null default 0" },
+        { "response", "avg_rank_cpu", "float not null default 0" },
+        { "response", "avg_refine_wall", "float not null default 0" },
+        { "response", "p95_refine_wall", "float not null default 0" },
+        { "response", "avg_refine_cpu", "float not null default 0" },
+        { "pms_clutseg", "min_inliers", "integer default 0" },
+        { "pms_clutseg", "min_depth_ratio", "float default 0" },
+        { "pms_clutseg", "max_extent", "float default 0" },
+        { "response", "test_stage_cpu", "float not null default 0" },
+        { "experiment", "claimed_by", "varchar(255) default null" },
+        { "experiment", "lease_expires", "datetime default null" }
+    };
+
+    /** \brief Reads the names of the columns of a table, which are empty if
+     * the table does not exist. */
+    static set<string> tableColumns(sqlite3* & db, const string & table) {
+        set<string> columns;
+        sqlite3_stmt *read;
+        db_prepare(db, read, "pragma table_info(" + table + ");");
+        while (sqlite3_step(read) == SQLITE_ROW) {
+            columns.insert((const char*) sqlite3_column_text(read, 1));
+        }
+        sqlite3_finalize(read);
+        return columns;
+    }
+
+    void upgradeSchema(sqlite3* & db) {
+        size_t n = sizeof(ADDED_COLUMNS) / sizeof(ADDED_COLUMNS[0]);
+        for (size_t i = 0; i < n; i++) {
+            const AddedColumn & c = ADDED_COLUMNS[i];
+            set<string> columns = tableColumns(db, c.table);
+            if (columns.empty()) {
+                throw ios_base::failure(str(boost::format(
+                    "Cannot upgrade database, table '%s' does not exist. "
+                    "Create the database from schema/ first.") % c.table));
+            }
+            if (columns.find(c.column) == columns.end()) {
+                cout << "[PARAMSEL] Adding column " << c.table << "." << c.column << " to database" << endl;
+                db_exec(db, boost::format("alter table %s add column %s %s;") % c.table % c.column % c.definition);
+            }
+        }
+    }
+
+    string enqueuedMarkerPath(sqlite3* db) {
+        const char *path = sqlite3_db_filename(db, "main");
+        if (path == NULL || *path == '\0') {
+            return "";
+        }
+        return string(path) + ".enqueued";
+    }
+
+    void notifyExperimentsEnqueued(sqlite3* db) {
+        string path = enqueuedMarkerPath(db);
+        if (!path.empty()) {
+            // Closing the file after writing is what wakes up the runners
+            ofstream marker(path.c_str(), ios_base::trunc);
+            marker << time(NULL) << endl;
+        }
+    }
+
     struct ExperimentModelbaseComparator {
         bool operator()(const Experiment & a, const Experiment & b) {
             return (a.train_set == b.train_set) ?
@@ -5,10 +5,15 @@
 #include "clutseg/ranking.h"
 
 #include "clutseg/common.h"
+#include "clutseg/pose.h"
+#include "clutseg/result.h"
 
 #include "clutseg/gcc_diagnostic_disable.h"
 #include <pcl/point_types.h>
+#include <algorithm>
 #include <boost/foreach.hpp>
+#include <sstream>
+#include <stdexcept>
 #include "clutseg/gcc_diagnostic_enable.h"
 
 using namespace cv;
@@ -17,6 +22,17 @@ using namespace tod;
 
 namespace clutseg {
 
+    void GuessRanking::scoreAll(const vector<Guess> & guesses, vector<float> & scores) const {
+        scores.resize(guesses.size());
+        for (size_t i = 0; i < guesses.size(); i++) {
+            scores[i] = (*this)(guesses[i]);
+        }
+    }
+
+    bool GuessRanking::needsInlierCloud() const {
+        return true;
+    }
+
     GuessComparator::GuessComparator() : ranking_(new InliersRanking()) {}
 
     GuessComparator::GuessComparator(const Ptr<GuessRanking> & ranking) : ranking_(ranking) {}
@@ -29,10 +45,18 @@ namespace clutseg {
         return 1.0;
     }
 
+    bool UniformRanking::needsInlierCloud() const {
+        return false;
+    }
+
     float InliersRanking::operator()(const Guess & guess) const {
         return guess.inliers.size();
     }
 
+    bool InliersRanking::needsInlierCloud() const {
+        return false;
+    }
+
     APrioriRanking::APrioriRanking(map<string, float> apriori_density) :
                                     apriori_density_(apriori_density) {}
 
@@ -45,16 +69,38 @@ namespace clutseg {
         }
     }
 
+    bool APrioriRanking::needsInlierCloud() const {
+        return false;
+    }
+
+    bool ProximityRanking::centroid(const pcl::PointCloud<pcl::PointXYZ> & cloud,
+                                    float & x, float & y, float & z) {
+        // Select instead of branch on NaN, such that the compiler can
+        // vectorize the loop. Points with unknown depth are all NaN.
+        const pcl::PointXYZ * p = cloud.points.empty() ? 0 : &cloud.points[0];
+        const size_t n = cloud.points.size();
+        float sx = 0, sy = 0, sz = 0, cnt = 0;
+        for (size_t i = 0; i < n; i++) {
+            bool valid = p[i].z == p[i].z;
+            sx += valid ? p[i].x : 0.0f;
+            sy += valid ? p[i].y : 0.0f;
+            sz += valid ? p[i].z : 0.0f;
+            cnt += valid ? 1.0f : 0.0f;
+        }
+        if (cnt == 0) {
+            return false;
+        }
+        x = sx / cnt;
+        y = sy / cnt;
+        z = sz / cnt;
+        return true;
+    }
+
     float ProximityRanking::operator()(const Guess & guess) const {
-        float x = 0, y = 0, z = 0;
-        BOOST_FOREACH(const pcl::PointXYZ p, guess.inlierCloud) {
-            x += p.x;
-            y += p.y;
-            z += p.z;
+        float x, y, z;
+        if (!centroid(guess.inlierCloud, x, y, z)) {
+            return 0.0;
         }
-        x /= guess.inlierCloud.size();
-        y /= guess.inlierCloud.size();
-        z /= guess.inlierCloud.size();
         return 1.0 / sqrt(x * x + y * y + z * z);
     }
 
@@ -66,4 +112,152 @@ namespace clutseg {
         return (*ranking1_)(guess) * (*ranking2_)(guess);
     }
 
+    void ProductRanking::scoreAll(const vector<Guess> & guesses, vector<float> & scores) const {
+        vector<float> scores2;
+        ranking1_->scoreAll(guesses, scores);
+        ranking2_->scoreAll(guesses, scores2);
+        for (size_t i = 0; i < scores.size(); i++) {
+            scores[i] *= scores2[i];
+        }
+    }
+
+    bool ProductRanking::needsInlierCloud() const {
+        return ranking1_->needsInlierCloud() || ranking2_->needsInlierCloud();
+    }
+
+    LinearRanking::LinearRanking(const vector<float> & weights,
+                                    const opencv_candidate::Camera & camera) :
+                                    weights_(weights), camera_(camera) {
+        if (weights_.size() != FEATURES + 1) {
+            throw runtime_error("LinearRanking expects a bias and one weight per feature");
+        }
+    }
+
+    float LinearRanking::operator()(const Guess & guess) const {
+        float f[FEATURES];
+        features(guess, guess.inlierCloud, camera_, f);
+        float score = weights_[0];
+        for (int i = 0; i < FEATURES; i++) {
+            score += weights_[i + 1] * f[i];
+        }
+        return score;
+    }
+
+    bool LinearRanking::needsInlierCloud() const {
+        return weights_[PROXIMITY + 1] != 0;
+    }
+
+    const vector<float> & LinearRanking::getWeights() const {
+        return weights_;
+    }
+
+    const opencv_candidate::Camera & LinearRanking::getCamera() const {
+        return camera_;
+    }
+
+    void LinearRanking::features(const Guess & guess,
+                                    const pcl::PointCloud<pcl::PointXYZ> & inlierCloud,
+                                    const opencv_candidate::Camera & camera,
+                                    float f[FEATURES]) {
+        size_t n = guess.inliers.size();
+        size_t m = guess.image_points_.size();
+        float err = 0;
+        size_t reprojected = 0;
+        if (n > 0 && !camera.K.empty() && guess.aligned_points_.size() == m) {
+            // Project only the template points of the inliers
+            vector<Point3f> op;
+            vector<Point2f> ip;
+            op.reserve(n);
+            ip.reserve(n);
+            BOOST_FOREACH(int idx, guess.inliers) {
+                if (idx >= 0 && size_t(idx) < m) {
+                    ip.push_back(guess.image_points_[idx]);
+                    op.push_back(guess.aligned_points_[idx]);
+                }
+            }
+            if (!op.empty()) {
+                opencv_candidate::PoseRT pose = poseToPoseRT(guess.aligned_pose());
+                vector<Point2f> projected;
+                projectPoints(Mat(op), pose.rvec, pose.tvec, camera.K, camera.D, projected);
+                for (size_t i = 0; i < projected.size(); i++) {
+                    float dx = projected[i].x - ip[i].x;
+                    float dy = projected[i].y - ip[i].y;
+                    err += sqrt(dx * dx + dy * dy);
+                }
+                reprojected = projected.size();
+            }
+        }
+        float x, y, z;
+        f[INLIERS] = n;
+        f[MATCHES] = m;
+        f[INLIER_RATIO] = m == 0 ? 0 : float(n) / m;
+        f[PROXIMITY] = ProximityRanking::centroid(inlierCloud, x, y, z) ? 1.0 / sqrt(x * x + y * y + z * z) : 0;
+        f[REPROJECTION_ERROR] = reprojected == 0 ? 0 : err / reprojected;
+    }
+
+    /** \brief Orders indices by descending score. Ties are broken by
+     * index, which makes any sort on it stable. */
+    struct ScoreComparator {
+
+        ScoreComparator(const vector<float> & scores) : scores(scores) {}
+
+        bool operator()(size_t a, size_t b) const {
+            return scores[a] > scores[b] || (scores[a] == scores[b] && a < b);
+        }
+
+        const vector<float> & scores;
+
+    };
+
+    void sortGuesses(vector<Guess> & guesses, const GuessRanking & ranking) {
+        selectGuesses(guesses, ranking, guesses.size());
+    }
+
+    void selectGuesses(vector<Guess> & guesses, const GuessRanking & ranking, size_t k) {
+        k = min(k, guesses.size());
+        vector<float> scores;
+        ranking.scoreAll(guesses, scores);
+        vector<size_t> order(guesses.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        partial_sort(order.begin(), order.begin() + k, order.end(), ScoreComparator(scores));
+        // Permute once, rather than moving guesses around while sorting.
+        // Every guess is moved at most once, so its points are not copied.
+        vector<Guess> selected(k);
+        for (size_t i = 0; i < k; i++) {
+            moveGuess(guesses[order[i]], selected[i]);
+        }
+        guesses.swap(selected);
+    }
+
+    size_t bestGuess(const vector<Guess> & guesses, const GuessRanking & ranking) {
+        vector<float> scores;
+        ranking.scoreAll(guesses, scores);
+        return max_element(scores.begin(), scores.end()) - scores.begin();
+    }
+
+    Ptr<GuessRanking> createRanking(const string & name) {
+        if (name.compare(0, 14, "LinearRanking ") == 0) {
+            istringstream in(name.substr(14));
+            vector<float> weights;
+            float w;
+            while (in >> w) {
+                weights.push_back(w);
+            }
+            if (!in.eof()) {
+                throw runtime_error("Cannot parse weights of ranking: " + name);
+            }
+            return new LinearRanking(weights);
+        } else if (name == "InliersRanking") {
+            return new InliersRanking(); 
+        } else if (name == "ProximityRanking") {
+            return new ProximityRanking();
+        } else if (name == "UniformRanking") {
+            return new UniformRanking();
+        } else {
+            throw runtime_error("Unknown ranking: " + name);
+        }
+    }
+
 }
@@ -100,7 +100,7 @@ namespace clutseg {
             }
         } else {
             if (result.guess_made) {
-                Guess lc = result.refine_choice;
+                const Guess & lc = result.refine_choice;
                 if (ground.onScene(lc.getObject()->name)) {
                     // True positive
                     double a;
@@ -165,7 +165,7 @@ namespace clutseg {
             if (resultSet.find(img_name) == resultSet.end()) {
                 throw runtime_error(str(boost::format("ERROR: No result for image '%s'") % img_name));
             }
-            Result r = resultSet.find(img_name)->second;
+            const Result & r = resultSet.find(img_name)->second;
 
             if (g.emptyScene()) {
                 if (r.guess_made) {
@@ -238,7 +238,7 @@ namespace clutseg {
             if (resultSet.find(img_name) == resultSet.end()) {
                 throw runtime_error(str(boost::format("ERROR: No result for image '%s'") % img_name));
             }
-            Result r = resultSet.find(img_name)->second;
+            const Result & r = resultSet.find(img_name)->second;
             update_detect_roc(r, g, templateNames, rsp);
             update_detect_sipc(r, g, templateNames, rsp.detect_sipc);
             update_refine_sipc(r, g, templateNames, rsp.refine_sipc);
@@ -19,4 +19,40 @@ namespace clutseg {
         return s;
     }
 
+    static void swapPoints(Guess & a, Guess & b) {
+        a.inliers.swap(b.inliers);
+        a.inlierCloud.points.swap(b.inlierCloud.points);
+        a.image_points_.swap(b.image_points_);
+        a.image_indices_.swap(b.image_indices_);
+        a.aligned_points_.swap(b.aligned_points_);
+    }
+
+    void moveGuess(Guess & src, Guess & dst) {
+        if (&src == &dst) {
+            return;
+        }
+        Guess tmp;
+        swapPoints(src, tmp);
+        // Copies only what is left, i.e. the pose, the object, the headers
+        // of the reference-counted matrices and the projected points. The
+        // latter are private to tod::Guess and can only be read, hence they
+        // cannot be swapped like the other containers.
+        dst = src;
+        swapPoints(tmp, dst);
+    }
+
+    void moveResult(Result & src, Result & dst) {
+        if (&src == &dst) {
+            return;
+        }
+        dst.guess_made = src.guess_made;
+        moveGuess(src.refine_choice, dst.refine_choice);
+        dst.refine_choices.swap(src.refine_choices);
+        dst.detect_choices.swap(src.detect_choices);
+        Features2d tmp;
+        tmp.keypoints.swap(src.features.keypoints);
+        dst.features = src.features;
+        dst.features.keypoints.swap(tmp.keypoints);
+    }
+
 }
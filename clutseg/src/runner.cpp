@@ -8,19 +8,24 @@
 #include "clutseg/clutseg.h"
 #include "clutseg/modelbase.h"
 #include "clutseg/paramsel.h"
+#include "clutseg/db.h"
 #include "clutseg/ranking.h"
 #include "clutseg/response.h"
 #include "clutseg/ground.h"
 
 #include "clutseg/gcc_diagnostic_disable.h"
+    #include <boost/bind.hpp>
     #include <boost/date_time/posix_time/posix_time.hpp>
     #include <boost/foreach.hpp>
     #include <boost/thread.hpp>
-    #include <ctime>
     #include <cv.h>
-    #include <pcl/io/pcd_io.h>
+    #include <fstream>
+    #include <opencv2/highgui/highgui.hpp>
     #include <string>
     #include <tod/detecting/Parameters.h>
+    #include <poll.h>
+    #include <sys/inotify.h>
+    #include <unistd.h>
 #include "clutseg/gcc_diagnostic_enable.h"
 
 using namespace cv;
@@ -32,13 +37,178 @@ namespace bfs = boost::filesystem;
 
 namespace clutseg {
 
-    ExperimentRunner::ExperimentRunner() : terminate(false) {}
+    /** \brief Identifies this process among all runners that share the
+     * database, possibly on several hosts. */
+    static string runnerId() {
+        char host[256];
+        if (gethostname(host, sizeof(host)) != 0) {
+            host[0] = '\0';
+        }
+        host[sizeof(host) - 1] = '\0';
+        return str(boost::format("%s:%d") % host % getpid());
+    }
+
+    const int ExperimentRunner::LEASE_SECONDS;
+    const int ExperimentRunner::POLL_SECONDS;
+
+    ExperimentRunner::ExperimentRunner() : terminate(false),
+                                        db_mutex_(new boost::mutex()),
+                                        workers_(1),
+                                        threads_(max(1u, boost::thread::hardware_concurrency())),
+                                        prefetch_bytes_(256 << 20),
+                                        test_sets_(new TestSetCache(size_t(1) << 30)),
+                                        runner_id_(runnerId()) {}
 
     ExperimentRunner::ExperimentRunner(sqlite3* db,
                                        const ModelbaseCache & cache,
-                                       const ResultStorage & storage) :
+                                       const ResultStorage & storage,
+                                       size_t test_set_cache_bytes) :
                                         terminate(false), db_(db),
-                                        cache_(cache), storage_(storage) {}
+                                        db_mutex_(new boost::mutex()),
+                                        cache_(cache), storage_(storage),
+                                        workers_(1),
+                                        threads_(max(1u, boost::thread::hardware_concurrency())),
+                                        prefetch_bytes_(256 << 20),
+                                        test_sets_(new TestSetCache(test_set_cache_bytes)),
+                                        runner_id_(runnerId()) {}
+
+    void ExperimentRunner::setWorkers(int workers) {
+        workers_ = max(1, workers);
+    }
+
+    int ExperimentRunner::getWorkers() const {
+        return workers_;
+    }
+
+    void ExperimentRunner::setThreads(int threads) {
+        threads_ = max(1, threads);
+    }
+
+    int ExperimentRunner::getThreads() const {
+        return threads_;
+    }
+
+    void ExperimentRunner::setPrefetchBytes(size_t prefetch_bytes) {
+        prefetch_bytes_ = prefetch_bytes;
+    }
+
+    size_t ExperimentRunner::getPrefetchBytes() const {
+        return prefetch_bytes_;
+    }
+
+    size_t ExperimentRunner::getTestSetCacheBytes() const {
+        return test_sets_->getBudgetBytes();
+    }
+
+    /** \brief Returns an inotify descriptor watching a file for being
+     * written, or -1 if the file cannot be watched. The file is created if
+     * it does not exist. */
+    static int watchFile(const string & path) {
+        if (path.empty()) {
+            return -1;
+        }
+        if (!bfs::exists(path)) {
+            ofstream create(path.c_str(), ios_base::app);
+        }
+        int fd = inotify_init1(IN_NONBLOCK);
+        if (fd >= 0 && inotify_add_watch(fd, path.c_str(), IN_CLOSE_WRITE) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    /** \brief Discards the events that have been queued on an inotify
+     * descriptor so far. */
+    static void drainEvents(int fd) {
+        char buf[4096];
+        while (fd >= 0 && read(fd, buf, sizeof(buf)) > 0) {}
+    }
+
+    void ExperimentRunner::waitForChange(int fd) {
+        // Check for termination every second, since a signal may interrupt
+        // another thread than this one.
+        for (int i = 1; !terminate; i++) {
+            if (fd < 0) {
+                sleep(1);
+            } else {
+                pollfd p;
+                p.fd = fd;
+                p.events = POLLIN;
+                if (poll(&p, 1, 1000) > 0) {
+                    return;
+                }
+            }
+            if (i % POLL_SECONDS == 0) {
+                boost::mutex::scoped_lock lock(*db_mutex_);
+                try {
+                    if (countExperimentsToRun(db_) > 0) {
+                        return;
+                    }
+                } catch (ios_base::failure & err) {
+                    // The database may be locked by another runner, try
+                    // again next time
+                    cerr << "[RUN]: ERROR, cannot poll for experiments: " << err.what() << endl;
+                }
+            }
+        }
+    }
+
+    bool ExperimentRunner::serializeExperiment(Experiment & e, bool claimed) {
+        boost::mutex::scoped_lock lock(*db_mutex_);
+        // Take the write lock right away, such that no other runner can
+        // claim the experiment between checking and writing
+        db_exec(db_, "begin immediate");
+        try {
+            if (claimed && !holdsClaim(db_, e.id, runner_id_)) {
+                cerr << "[RUN]: WARNING, lease expired and experiment has been claimed by another runner, discarding results (id=" << e.id << ")" << endl;
+                db_exec(db_, "rollback");
+                return false;
+            }
+            e.serialize(db_);
+        } catch (...) {
+            db_exec(db_, "rollback");
+            throw;
+        }
+        db_exec(db_, "commit");
+        return true;
+    }
+
+    bool ExperimentRunner::claimExperiment(const Experiment & e) {
+        boost::mutex::scoped_lock lock(*db_mutex_);
+        bool claimed = false;
+        try {
+            claimed = clutseg::claimExperiment(db_, e.id, runner_id_, LEASE_SECONDS);
+        } catch (std::exception & err) {
+            cerr << "[RUN]: ERROR, cannot claim experiment (id=" << e.id << "): " << err.what() << endl;
+            return false;
+        }
+        if (!claimed) {
+            cerr << "[RUN]: Skipping experiment claimed by another runner (id=" << e.id << ")" << endl;
+        }
+        return claimed;
+    }
+
+    void ExperimentRunner::releaseClaims() {
+        boost::mutex::scoped_lock lock(*db_mutex_);
+        clutseg::releaseClaims(db_, runner_id_);
+    }
+
+    void ExperimentRunner::renewClaimsPeriodically() {
+        try {
+            while (true) {
+                boost::this_thread::sleep(boost::posix_time::seconds(LEASE_SECONDS / 3));
+                boost::mutex::scoped_lock lock(*db_mutex_);
+                try {
+                    renewClaims(db_, runner_id_, LEASE_SECONDS);
+                } catch (ios_base::failure & err) {
+                    // Try again next time, the lease lasts for a few more periods
+                    cerr << "[RUN]: ERROR, cannot renew leases: " << err.what() << endl;
+                }
+            }
+        } catch (boost::thread_interrupted &) {
+        }
+    }
 
     bfs::path cloudPath(const bfs::path & img_path) {
         string fn = img_path.filename();
@@ -74,64 +244,82 @@ namespace clutseg {
     // Clutsegmenter can fill in. It can become a member of a report specific
     // to a test scene.
     #pragma GCC diagnostic ignored "-Wunused-parameter"
-    void ExperimentRunner::runExperiment(Clutsegmenter & sgm, Experiment & e) {
+    void ExperimentRunner::runExperiment(Clutsegmenter & sgm, Experiment & e, size_t workers) {
         bfs::path p = getenv("CLUTSEG_PATH");
         bfs::path test_dir = p / e.test_set;
-        GroundTruth  testdesc = loadGroundTruth(test_dir / "ground-truth.txt");
+        // Keeps the scenes alive even if the cache evicts them meanwhile
+        boost::shared_ptr<const TestSet> test_set = test_sets_->get(test_dir);
+        const GroundTruth & testdesc = test_set->ground_truth;
+        const Camera & camera = test_set->camera;
         SetResult resultSet;
-        bfs::path camera_path = test_dir / "camera.yml";
-        assert_path_exists(camera_path);
-        Camera camera(camera_path.string(), Camera::TOD_YAML);
-        // http://www.gnu.org/s/libc/manual/html_mono/libc.html#CPU-Time
-        float rt = 0;
-        // Loop over all images in the test set
-        for (GroundTruth::iterator test_it = testdesc.begin(); test_it != testdesc.end(); test_it++) {
-            string img_name = test_it->first;
-            bfs::path img_path = test_dir / img_name;
-            Mat queryImage = imread(img_path.string());
-            if (queryImage.empty()) {
-                throw runtime_error(str(boost::format(
-                    "ERROR: Cannot read image '%s' for eeriment with id=%d. Please check\n"
-                    "whether image file exists. Full path is '%s'."
-                ) % img_name % e.id % img_path));
+        sgm.setCamera(camera);
+        // Loop over all images in the test set, recognizing a batch of images
+        // at once on this worker's share of the cores. Batches are kept
+        // small. Unless the test set has been cached, the scenes are loaded
+        // in the background within this worker's share of the prefetch
+        // budget, such that only a few images and clouds are held in memory.
+        int threads = max(1, threads_ / int(workers));
+        size_t batch_size = threads;
+        Ptr<SceneLoader> loader;
+        if (test_set->scenes.empty()) {
+            vector<string> img_names;
+            for (GroundTruth::const_iterator it = testdesc.begin(); it != testdesc.end(); it++) {
+                img_names.push_back(it->first);
             }
-            cout << "[RUN] " << e.name << " - loaded image " << img_path << endl;
-            PointCloudT queryCloud;
-            bfs::path cloud_path = cloudPath(img_path);
-            if (bfs::exists(cloud_path)) {
-                pcl::io::loadPCDFile(cloud_path.string(), queryCloud);
-                cout << "[RUN] Loaded query cloud " << cloud_path << endl;
+            loader = new SceneLoader(test_dir, img_names, prefetch_bytes_ / workers);
+        }
+        GroundTruth::const_iterator test_it = testdesc.begin();
+        while (test_it != testdesc.end()) {
+            vector<GroundTruth::const_iterator> batch;
+            vector<Query> queries;
+            for (; test_it != testdesc.end() && batch.size() < batch_size; test_it++) {
+                string img_name = test_it->first;
+                Query query;
+                if (loader.empty()) {
+                    query = test_set->scenes.find(img_name)->second;
+                } else {
+                    loader->next(img_name, query);
+                    cout << "[RUN] " << e.name << " - loaded image " << img_name << endl;
+                }
+                queries.push_back(query);
+                batch.push_back(test_it);
+            }
+
+            vector<Result> results;
+            sgm.recognizeBatch(queries, results, threads);
+
+            for (size_t i = 0; i < batch.size(); i++) {
+                string img_name = batch[i]->first;
+                Result & res = results[i];
+                cout << "[RUN] Recognized " << (res.guess_made ? res.refine_choice.getObject()->name : "NONE") << endl;
+     
+                TestReport report(e, queries[i], res, batch[i]->second, img_name, test_dir, camera,
+                                    sgm.getMapNeighbourhood());
+                storage_.record(report);
+                moveResult(res, resultSet[img_name]);
             }
-            Query query(queryImage, queryCloud);
-            Result res;
-            clock_t b = clock();
-            sgm.recognize(query, res);
-            rt += float(clock() - b) / CLOCKS_PER_SEC;
-            cout << "[RUN] Recognized " << (res.guess_made ? res.refine_choice.getObject()->name : "NONE") << endl;
-            resultSet[img_name] = res;
- 
-            TestReport report(e, query, res, test_it->second, img_name, test_dir, camera);
-            storage_.record(report);
 
             if (terminate) {
                 cout << "[RUN] Registered termination request. Program will be terminated as soon as the modelbase.has been carried out completely." << endl;
             }
 
-            // The heavy load on both CPU and IO often makes the operating
-            // system very unresponsive, so take a little break. This can
-            // probably also achieved by adjusting 'nice' value.
-            timespec t;
-            t.tv_sec = 0;
-            t.tv_nsec = int(1e8);
-            nanosleep(&t, NULL);
         }
 
         CutSseResponseFunction responseFunc;
         responseFunc(resultSet, testdesc, sgm.getTemplateNames(), e.response);
 
-        e.response.test_runtime = rt;
+        // The processor time is measured per thread, such that it neither
+        // depends on the number of cores nor includes the experiments that
+        // run concurrently on other workers, or the loading of scenes.
+        ClutsegmenterStats stats = sgm.getStats();
+        e.response.test_runtime = stats.recognize_latency.acc_cpu;
+        e.response.test_stage_cpu = stats.extract_latency.acc_cpu
+                                + stats.detect_latency.acc_cpu
+                                + stats.map_latency.acc_cpu
+                                + stats.rank_latency.acc_cpu
+                                + stats.refine_latency.acc_cpu;
 
-        sgm.getStats().populateResponse(e.response);
+        stats.populateResponse(e.response);
         e.record_time();
         e.record_commit();
         e.has_run = true;
@@ -155,7 +343,7 @@ namespace clutseg {
                     e.machine_note = "Bad train_pms_fe, FeatureExtractor::create failed";
                     e.skip = true; 
                     e.flags |= Experiment::FLAG_FEPARAMS_INVALID;
-                    e.serialize(db_);
+                    serializeExperiment(e);
                     continue;
                 }
                 try {
@@ -166,7 +354,7 @@ namespace clutseg {
                     e.machine_note = "Bad recog_pms_fe, FeatureExtractor::create failed";
                     e.skip = true; 
                     e.flags |= Experiment::FLAG_FEPARAMS_INVALID;
-                    e.serialize(db_);
+                    serializeExperiment(e);
                     continue;
                 }
                 e.flags |= Experiment::FLAG_FEPARAMS_VALID;
@@ -192,7 +380,7 @@ namespace clutseg {
                     e.machine_note = "Bad train_pms_fe, no features extracted";
                     e.skip = true; 
                     e.flags |= Experiment::FLAG_FEPARAMS_BAD;
-                    e.serialize(db_);
+                    serializeExperiment(e);
                     continue;
                 } else {
                     cout << "[RUN]: " << xf.keypoints.size() << " keypoints extracted on a validation image using train_pms_fe of " << e.name << endl;
@@ -206,7 +394,7 @@ namespace clutseg {
                     e.machine_note = "Bad recog_pms_fe, no features extracted";
                     e.skip = true; 
                     e.flags |= Experiment::FLAG_FEPARAMS_BAD;
-                    e.serialize(db_);
+                    serializeExperiment(e);
                     continue;
                 } else {
                     cout << "[RUN]: " << yf.keypoints.size() << " keypoints extracted on a validation image using recog_pms_fe of " << e.name << endl;
@@ -220,105 +408,269 @@ namespace clutseg {
         tr_feat.generate();
     }
 
+    struct ExperimentRunner::ExperimentQueue {
+
+        ExperimentQueue(vector<Experiment*> & exps, size_t workers) :
+                        exps(exps), workers(workers), next(0), ran(0) {}
+
+        /** \brief Returns the next experiment to run, or NULL if there are
+         * none left. */
+        Experiment* pop() {
+            boost::mutex::scoped_lock lock(mutex);
+            return next < exps.size() ? exps[next++] : NULL;
+        }
+
+        /** \brief Counts an experiment whose results have been recorded. */
+        void done() {
+            boost::mutex::scoped_lock lock(mutex);
+            ran++;
+        }
+
+        vector<Experiment*> & exps;
+        /** \brief Number of workers that take experiments from the queue,
+         * which share the cores and the prefetch budget. */
+        size_t workers;
+        size_t next;
+        size_t ran;
+        boost::mutex mutex;
+
+    };
+
+    void ExperimentRunner::markFailed(Experiment & e, const string & error) {
+        cerr << "[RUN]: " << error << endl;
+        cerr << "[RUN]: ERROR, experiment failed, no results recorded (id=" << e.id << ")" << endl;
+        cerr << "[RUN]: Before running the experiment again, make sure to clear 'skip' flag in experiment record." << endl;
+        e.skip = true;
+        e.machine_note = error.substr(0, 200);
+        try {
+            serializeExperiment(e, true);
+        } catch (std::exception & err) {
+            cerr << "[RUN]: ERROR, cannot mark experiment as failed (id=" << e.id << "): " << err.what() << endl;
+        }
+    }
+
+    void ExperimentRunner::experimentWorker(const Clutsegmenter & prototype, ExperimentQueue & queue) {
+        // A copy shares the modelbase and the matcher indices with the
+        // prototype, but has parameters and statistics of its own. It is
+        // kept for all experiments this worker runs. If an experiment
+        // changes the feature extraction or matcher parameters, this worker
+        // builds indices of its own, which costs the time and memory of a
+        // full index per worker.
+        Clutsegmenter sgm(prototype);
+        Experiment *e;
+        while (!terminate && (e = queue.pop()) != NULL) {
+            // Another runner might have taken the experiment while the
+            // modelbase has been trained
+            if (!claimExperiment(*e)) {
+                continue;
+            }
+            // Exceptions must not leave the worker thread, which would
+            // terminate the whole runner
+            string error;
+            try {
+                // Clear statistics        
+                sgm.resetStats();
+
+                // Online change configuration
+                sgm.reconfigure(e->paramset);
+
+                runExperiment(sgm, *e, queue.workers);
+                if (serializeExperiment(*e, true)) {
+                    queue.done();
+                }
+            } catch (std::exception & err) {
+                error = err.what();
+            } catch (...) {
+                error = "unknown exception";
+            }
+            if (!error.empty()) {
+                markFailed(*e, error);
+            }
+        }
+    }
+
+    size_t ExperimentRunner::runExperiments(Clutsegmenter & prototype, vector<Experiment*> & exps) {
+        if (exps.empty()) {
+            return 0;
+        }
+        // Build the feature extractors and matcher indices before the
+        // workers copy the prototype, such that they share them. If the
+        // parameters of the first experiment are broken, try the next one.
+        while (!exps.empty()) {
+            string error;
+            try {
+                prototype.reconfigure(exps[0]->paramset);
+                prototype.prepare();
+                break;
+            } catch (std::exception & err) {
+                error = err.what();
+            } catch (...) {
+                error = "unknown exception";
+            }
+            if (claimExperiment(*exps[0])) {
+                markFailed(*exps[0], error);
+            }
+            exps.erase(exps.begin());
+        }
+        if (exps.empty()) {
+            return 0;
+        }
+        size_t n = min(size_t(workers_), exps.size());
+        ExperimentQueue queue(exps, n);
+        if (n == 1) {
+            experimentWorker(prototype, queue);
+        } else {
+            boost::thread_group workers;
+            for (size_t i = 0; i < n; i++) {
+                workers.create_thread(boost::bind(&ExperimentRunner::experimentWorker,
+                                        this, boost::cref(prototype), boost::ref(queue)));
+            }
+            workers.join_all();
+        }
+        exps.clear();
+        return queue.ran;
+    }
+
+    bool ExperimentRunner::nextGroup(vector<Experiment> & exps, size_t & i, vector<Experiment*> & group) {
+        Modelbase tr_feat(exps[i].train_set, exps[i].paramset.train_pms_fe);
+        for (; i < exps.size(); i++) {
+            Experiment & e = exps[i];
+            if (e.skip) {
+                cerr << "[RUN]: Skipping experiment (id=" << e.id << ")" << endl;
+                continue;
+            }
+            if (Modelbase(e.train_set, e.paramset.train_pms_fe) != tr_feat) {
+                break;
+            }
+            group.push_back(&e);
+        }
+        return !group.empty();
+    }
+
+    bool ExperimentRunner::trainModelbase(const Modelbase & tr_feat, vector<Experiment*> & group) {
+        if (cache_.modelbaseExist(tr_feat)) {
+            return true;
+        }
+        // Claiming one experiment is enough to keep other runners from
+        // training the same modelbase, whereas claiming all of them would
+        // keep them from running the experiments while this runner trains.
+        Experiment *training_lock = NULL;
+        BOOST_FOREACH(Experiment *e, group) {
+            if (claimExperiment(*e)) {
+                training_lock = e;
+                break;
+            }
+        }
+        if (training_lock == NULL) {
+            // Another runner is training the modelbase or has run the
+            // experiments already
+            return false;
+        }
+        int max_seconds = 2400;
+        bool trained = false;
+        if (!cache_.modelbaseBlacklisted(tr_feat)) {
+            // This is a critical part where the experiment runner
+            // should not be interrupted. Also proper closing of
+            // the database has to be ensured by a database handler
+            boost::thread g(generate, tr_feat);
+            // 10 seconds per picture max, 4*60 = 240 pictures in total
+            // so maximum 2400 seconds = 40 minutes.
+            if (g.timed_join(boost::posix_time::seconds(max_seconds))) {
+                if (terminate) {
+                    return false;
+                }
+                cerr << "[RUN]: Adding training features to cache " << training_lock->name << endl;
+                cache_.addModelbase(tr_feat);
+                trained = true;
+            } else {
+                cache_.blacklistModelbase(tr_feat);
+                g.interrupt();
+                g.join();
+                cerr << "[RUN]: ERROR, took more than " << max_seconds << " seconds for training: " << training_lock->name << endl;
+            }
+        }
+        if (!trained) {
+            BOOST_FOREACH(Experiment *e, group) {
+                if (e != training_lock && !claimExperiment(*e)) {
+                    continue;
+                }
+                e->skip = true;
+                e->flags |= Experiment::FLAG_TRAIN_TIMEOUT;
+                e->machine_note = str(boost::format("took longer than %d for training") % max_seconds);
+                serializeExperiment(*e, true);
+            }
+        }
+        return trained;
+    }
+
     void ExperimentRunner::run() {
+        boost::thread heartbeat(boost::bind(&ExperimentRunner::renewClaimsPeriodically, this));
+        // Watch for someone enqueueing new experiments. The experiment
+        // runner can run as a kind of daemon which dispatches requests for
+        // new experiments. Notifications sent while the database is queried
+        // are queued on the descriptor, so none of them are missed.
+        int watch = watchFile(enqueuedMarkerPath(db_));
         while (!terminate) {
+            drainEvents(watch);
             cout << "[RUN] Querying database for experiments to carry out..." << endl;
             vector<Experiment> exps;
-            selectExperimentsNotRun(db_, exps);
+            {
+                boost::mutex::scoped_lock lock(*db_mutex_);
+                selectExperimentsNotRun(db_, exps);
+            }
             if (exps.empty()) {
-                // Wait for someone inserting new rows into the database. The
-                // experiment runner can run as a kind of daemon which
-                // dispatches requests for new experiments.
-                sleep(1);
+                waitForChange(watch);
                 continue;
             }
             // Make it more likely that the training features do not have to be
             // reload. Since it is only a few seconds, it does not matter too
             // much, though.
             sortExperimentsByModelbase(exps);
-            Modelbase cur_tr_feat;
-            Clutsegmenter *sgm = NULL;
+            size_t ran = 0;
 
             skipExperimentsWhereFeatureExtractorCreateFailed(exps);
             if (terminate) {
-                return;
+                break;
             }
             skipExperimentsWhereNoFeaturesExtracted(exps);
             if (terminate) {
-                return;
+                break;
             }
 
-            BOOST_FOREACH(Experiment & e, exps) {
-                if (terminate) {
-                    break;
-                } else if (e.skip) {
-                    cerr << "[RUN]: Skipping experiment (id=" << e.id << ")" << endl;
-                } else {
-                    Modelbase tr_feat(e.train_set, e.paramset.train_pms_fe);
-                    if (tr_feat != cur_tr_feat) {
-                        if (!cache_.modelbaseExist(tr_feat)) {
-                            int max_seconds = 2400;
-                            if (cache_.modelbaseBlacklisted(tr_feat)) {
-                                e.skip = true;
-                                e.flags |= Experiment::FLAG_TRAIN_TIMEOUT;
-                                e.machine_note = str(boost::format("took longer than %d for training") % max_seconds);
-                                e.serialize(db_);
-                                continue;
-                            }
-                            // This is a critical part where the experiment runner
-                            // should not be interrupted. Also proper closing of
-                            // the database has to be ensured by a database handler
-                            boost::thread g(generate, tr_feat);
-                            // 10 seconds per picture max, 4*60 = 240 pictures in total
-                            // so maximum 2400 seconds = 40 minutes.
-                            if (g.timed_join(boost::posix_time::seconds(max_seconds))) {
-                                if (terminate) break;
-                                cerr << "[RUN]: Adding training features to cache " << e.name << endl;
-                                cache_.addModelbase(tr_feat);
-                            } else {
-                                cache_.blacklistModelbase(tr_feat);
-                                e.skip = true;
-                                e.flags |= Experiment::FLAG_TRAIN_TIMEOUT;
-                                e.machine_note = str(boost::format("took longer than %d for training") % max_seconds);
-                                e.serialize(db_);
-                                g.interrupt();
-                                g.join();
-                                cerr << "[RUN]: ERROR, took more than " << max_seconds << " seconds for training: " << e.name << endl;
-                                continue;
-                            }
-                        }
-                        delete sgm;
-                        sgm = new Clutsegmenter(
-                            cache_.modelbaseDir(tr_feat).string(),
-                            TODParameters(), TODParameters());
-                    }
-
-                    e.response.train_runtime = cache_.trainRuntime(tr_feat);                    
-
-                    // Clear statistics        
-                    sgm->resetStats();
-
-                    // Online change configuration
-                    sgm->reconfigure(e.paramset);
-                    
-                    try {
-                        runExperiment(*sgm, e);
-                        e.serialize(db_);
-                    } catch( runtime_error & err ) {
-                        cerr << "[RUN]: " << err.what() << endl;
-                        cerr << "[RUN]: ERROR, experiment failed, no results recorded (id=" << e.id << ")" << endl;
-                        cerr << "[RUN]: Before running the experiment again, make sure to clear 'skip' flag in experiment record." << endl;
-                        e.skip = true;
-                        e.serialize(db_);
+            size_t i = 0;
+            while (i < exps.size() && !terminate) {
+                // The experiments are claimed one by one as the workers
+                // take them, such that concurrent runners share the
+                // experiments on a modelbase. The leases are renewed while
+                // training and running.
+                Modelbase tr_feat(exps[i].train_set, exps[i].paramset.train_pms_fe);
+                vector<Experiment*> group;
+                if (!nextGroup(exps, i, group)) {
+                    continue;
+                }
+                if (trainModelbase(tr_feat, group)) {
+                    Clutsegmenter sgm(cache_.modelbaseDir(tr_feat).string(),
+                                        TODParameters(), TODParameters());
+                    BOOST_FOREACH(Experiment *e, group) {
+                        e->response.train_runtime = cache_.trainRuntime(tr_feat);
                     }
+                    ran += runExperiments(sgm, group);
                 }
-            }
-            if (sgm != NULL) {
-                delete sgm;
+                // Let other runners take over what has not been run
+                releaseClaims();
             }
 
-            sleep(3);
+            if (ran == 0) {
+                // All remaining experiments are skipped or run elsewhere
+                waitForChange(watch);
+            }
+        }
+        if (watch >= 0) {
+            close(watch);
         }
+        heartbeat.interrupt();
+        heartbeat.join();
+        releaseClaims();
     }
 
 }
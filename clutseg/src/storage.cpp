@@ -4,12 +4,16 @@
 
 #include "clutseg/storage.h"
 
+#include "clutseg/map.h"
 #include "clutseg/pose.h"
+#include "clutseg/ranking.h"
+#include "clutseg/sipc.h"
 #include "clutseg/viz.h"
 
 #include "clutseg/gcc_diagnostic_disable.h"
     #include <boost/foreach.hpp>
     #include <boost/format.hpp>
+    #include <fstream>
     #include <iostream>
     #include <opencv2/highgui/highgui.hpp>
     #include <tod/core/Features2d.h>
@@ -109,6 +113,34 @@ namespace clutseg {
         }
         writeLabelSet(dc_path, dls);
 
+        // Save the ranking features of the detect choices, and whether they
+        // are correct, such that a LinearRanking can be learned offline.
+        bfs::path df_path = erd / (img_basename + ".detect_choices.features.csv");
+        ofstream df(df_path.string().c_str());
+        df << "object,correct,inliers,matches,inlier_ratio,proximity,reprojection_error" << endl;
+        BOOST_FOREACH(const Guess & c, report.result.detect_choices) {
+            // Inliers are only mapped to the query cloud if the ranking in
+            // use needs them
+            PointCloudT mapped;
+            const PointCloudT * inlierCloud = &c.inlierCloud;
+            if (inlierCloud->empty() && !c.inliers.empty()) {
+                mapInliersToCloud(mapped, c, report.query.img, *report.query.cloud, report.map_neighbourhood);
+                inlierCloud = &mapped;
+            }
+            float f[LinearRanking::FEATURES];
+            LinearRanking::features(c, *inlierCloud, report.camera, f);
+            bool correct = false;
+            PoseRT est = poseToPoseRT(c.aligned_pose());
+            BOOST_FOREACH(const PoseRT & p, report.ground.posesOf(c.getObject()->name)) {
+                correct = correct || (angle_between(est, p) <= CLUTSEG_SIPC_MAX_ANGLE && dist_between(est, p) <= CLUTSEG_SIPC_MAX_TRANS);
+            }
+            df << c.getObject()->name << "," << correct;
+            for (int i = 0; i < LinearRanking::FEATURES; i++) {
+                df << "," << f[i];
+            }
+            df << endl;
+        }
+
         TODParameters dp = report.experiment.paramset.toDetectTodParameters();
         store_config(erd / "detect.config.yaml", dp);
 
@@ -0,0 +1,94 @@
+/*
+ * Author: Julius Adorf
+ */
+
+#include "clutseg/timing.h"
+
+#include "clutseg/gcc_diagnostic_disable.h"
+    #include <algorithm>
+    #include <cmath>
+#include "clutseg/gcc_diagnostic_enable.h"
+
+using namespace std;
+
+namespace clutseg {
+
+    static double elapsed(const timespec & since, clockid_t clock) {
+        timespec now;
+        clock_gettime(clock, &now);
+        return (now.tv_sec - since.tv_sec) + (now.tv_nsec - since.tv_nsec) * 1e-9;
+    }
+
+    Stopwatch::Stopwatch() {
+        restart();
+    }
+
+    void Stopwatch::restart() {
+        clock_gettime(CLOCK_MONOTONIC, &wall_);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_);
+    }
+
+    double Stopwatch::wall() const {
+        return elapsed(wall_, CLOCK_MONOTONIC);
+    }
+
+    double Stopwatch::cpu() const {
+        return elapsed(cpu_, CLOCK_THREAD_CPUTIME_ID);
+    }
+
+    const int LatencyStats::BINS;
+
+    LatencyStats::LatencyStats() : count(0), acc_wall(0), acc_cpu(0) {
+        fill(hist, hist + BINS, 0);
+    }
+
+    void LatencyStats::add(double wall, double cpu) {
+        count++;
+        acc_wall += wall;
+        acc_cpu += cpu;
+        int bin = 0;
+        if (wall > 1e-6) {
+            bin = min(BINS - 1, int(floor(4 * log(wall * 1e6) / log(2.0))));
+        }
+        hist[bin]++;
+    }
+
+    void LatencyStats::add(const Stopwatch & watch) {
+        add(watch.wall(), watch.cpu());
+    }
+
+    LatencyStats & LatencyStats::operator+=(const LatencyStats & rhs) {
+        count += rhs.count;
+        acc_wall += rhs.acc_wall;
+        acc_cpu += rhs.acc_cpu;
+        for (int i = 0; i < BINS; i++) {
+            hist[i] += rhs.hist[i];
+        }
+        return *this;
+    }
+
+    double LatencyStats::avgWall() const {
+        return count == 0 ? 0 : acc_wall / count;
+    }
+
+    double LatencyStats::avgCpu() const {
+        return count == 0 ? 0 : acc_cpu / count;
+    }
+
+    double LatencyStats::wallPercentile(double p) const {
+        if (count == 0) {
+            return 0;
+        }
+        long rank = long(ceil(p * count));
+        long acc = 0;
+        int bin = 0;
+        for (; bin < BINS - 1; bin++) {
+            acc += hist[bin];
+            if (acc >= rank) {
+                break;
+            }
+        }
+        return pow(2.0, (bin + 1) / 4.0) * 1e-6;
+    }
+
+}
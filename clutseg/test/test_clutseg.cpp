@@ -13,6 +13,9 @@
 #include "clutseg/viz.h"
 
 #include "clutseg/gcc_diagnostic_disable.h"
+    #include <boost/bind.hpp>
+    #include <boost/foreach.hpp>
+    #include <boost/thread.hpp>
     #include <gtest/gtest.h>
     #include <limits.h>
     #include <tod/detecting/Loader.h>
@@ -76,6 +79,7 @@ class test_clutseg : public ::testing::Test {
             assert(!clutter_truth.labels.empty());
 
             camera = Camera("./data/camera.yml", Camera::TOD_YAML);
+            sgm.setCamera(camera);
         }
 
         static Clutsegmenter sgm;
@@ -128,6 +132,9 @@ class test_clutseg : public ::testing::Test {
                 EXPECT_EQ(0, sgm.getStats().acc_refine_choice_inliers);
             }
             EXPECT_TRUE(clutter_truth.onScene(res.refine_choice.getObject()->name));
+            ASSERT_EQ(1, res.refine_choices.size());
+            EXPECT_EQ(res.refine_choice.getObject()->name, res.refine_choices[0].getObject()->name);
+            EXPECT_EQ(res.refine_choice.inliers, res.refine_choices[0].inliers);
         }
 
         void showGuessAndGroundTruth(const string & test_name, const Guess & choice) {
@@ -171,6 +178,20 @@ TEST_F(test_clutseg, constructor_opaque) {
     EXPECT_NE("SIFT", s.getDetectParams().feParams.detector_type);
 }
 
+/** Check whether recognition refuses to run without camera parameters
+ * rather than producing poses from an empty camera matrix. */
+TEST_F(test_clutseg, recog_without_camera) {
+    SKIP_IF_FAST 
+
+    Clutsegmenter s(
+        cache.modelbaseDir(tr_feat).string(),
+        TODParameters(),
+        TODParameters()
+    );
+    Query query(haltbare_milch_train_img, haltbare_milch_train_cloud);
+    EXPECT_THROW(s.recognize(query, res), runtime_error);
+}
+
 /** Check whether the params returned is actually a reference to the
  * Clutsegmenter's parameters and that changes shine through. In this way,
  * parameter configuration can be changed easily without having to reload the
@@ -184,6 +205,65 @@ TEST_F(test_clutseg, change_params_online) {
     EXPECT_TRUE(sgm.getRefineParams().matcherParams.doRatioTest);
 }
 
+/** Exposes the matcher indices of a segmenter, which share them with the
+ * segmenter it has been copied from. */
+class ClutsegmenterProbe : public Clutsegmenter {
+
+    public:
+
+        typedef Clutsegmenter::MatcherPool MatcherPool;
+
+        ClutsegmenterProbe(const Clutsegmenter & sgm) : Clutsegmenter(sgm) {}
+
+        cv::Ptr<MatcherPool> detectMatchers() {
+            return getDetectMatchers();
+        }
+
+        cv::Ptr<MatcherPool> refineMatchers(const string & name) {
+            return getRefineModel(name).matchers;
+        }
+
+};
+
+/** Check whether the detect index survives across queries, and whether it
+ * is rebuilt once the detect matcher parameters change. */
+TEST_F(test_clutseg, keep_detect_index) {
+    SKIP_IF_FAST 
+
+    ClutsegmenterProbe probe(sgm);
+    Query query(haltbare_milch_train_img, haltbare_milch_train_cloud);
+    probe.recognize(query, res);
+    // Keep the pool alive, such that a new one cannot take its address
+    Ptr<ClutsegmenterProbe::MatcherPool> matchers = probe.detectMatchers();
+    probe.recognize(query, res);
+    EXPECT_EQ((ClutsegmenterProbe::MatcherPool *) matchers,
+                (ClutsegmenterProbe::MatcherPool *) probe.detectMatchers());
+    probe.getDetectParams().matcherParams.knn--;
+    probe.recognize(query, res);
+    EXPECT_NE((ClutsegmenterProbe::MatcherPool *) matchers,
+                (ClutsegmenterProbe::MatcherPool *) probe.detectMatchers());
+}
+
+/** Check whether the refine index of a template survives across queries,
+ * and whether it is rebuilt once the refine matcher parameters change. */
+TEST_F(test_clutseg, keep_refine_index) {
+    SKIP_IF_FAST 
+
+    ClutsegmenterProbe probe(sgm);
+    Query query(haltbare_milch_train_img, haltbare_milch_train_cloud);
+    probe.recognize(query, res);
+    ASSERT_TRUE(res.guess_made);
+    string name = res.refine_choice.getObject()->name;
+    Ptr<ClutsegmenterProbe::MatcherPool> matchers = probe.refineMatchers(name);
+    probe.recognize(query, res);
+    EXPECT_EQ((ClutsegmenterProbe::MatcherPool *) matchers,
+                (ClutsegmenterProbe::MatcherPool *) probe.refineMatchers(name));
+    probe.getRefineParams().matcherParams.knn--;
+    probe.recognize(query, res);
+    EXPECT_NE((ClutsegmenterProbe::MatcherPool *) matchers,
+                (ClutsegmenterProbe::MatcherPool *) probe.refineMatchers(name));
+}
+
 /** Check whether detection works for a training image. This is expected to
  * return with a whole bunch of inliers since it is only a training image. */
 TEST_F(test_clutseg, recog_haltbare_milch) {
@@ -198,6 +278,50 @@ TEST_F(test_clutseg, recog_haltbare_milch) {
     EXPECT_GT(res.refine_choice.inliers.size(), 10);
 }
 
+/** Check whether two threads can recognize objects concurrently with the same
+ * segmenter, and that both contribute to the statistics. */
+TEST_F(test_clutseg, recog_concurrently) {
+    SKIP_IF_FAST 
+
+    Query query(haltbare_milch_train_img, haltbare_milch_train_cloud);
+    Result res_a;
+    Result res_b;
+    ClutsegmenterStats stats_b;
+    typedef void (Clutsegmenter::*Recognize)(const Query &, Result &);
+    typedef void (Clutsegmenter::*RecognizeWithStats)(const Query &, Result &, ClutsegmenterStats &);
+    boost::thread a(boost::bind(Recognize(&Clutsegmenter::recognize), &sgm, boost::cref(query), boost::ref(res_a)));
+    boost::thread b(boost::bind(RecognizeWithStats(&Clutsegmenter::recognize), &sgm, boost::cref(query), boost::ref(res_b), boost::ref(stats_b)));
+    a.join();
+    b.join();
+    EXPECT_TRUE(res_a.guess_made);
+    EXPECT_TRUE(res_b.guess_made);
+    EXPECT_EQ("haltbare_milch", res_a.refine_choice.getObject()->name);
+    EXPECT_EQ("haltbare_milch", res_b.refine_choice.getObject()->name);
+    EXPECT_EQ(1, sgm.getStats().queries);
+    EXPECT_EQ(1, stats_b.queries);
+}
+
+/** Check whether batch recognition returns the results in input order and
+ * accounts for every query in the statistics. */
+TEST_F(test_clutseg, recog_batch) {
+    SKIP_IF_FAST 
+
+    vector<Query> queries;
+    queries.push_back(Query(haltbare_milch_train_img, haltbare_milch_train_cloud));
+    queries.push_back(Query(clutter_img, clutter_cloud));
+    queries.push_back(Query(haltbare_milch_train_img, haltbare_milch_train_cloud));
+    vector<Result> results;
+    sgm.recognizeBatch(queries, results, 2);
+    ASSERT_EQ(3, results.size());
+    EXPECT_EQ(3, sgm.getStats().queries);
+    EXPECT_EQ(3, sgm.getStats().recognize_latency.count);
+    EXPECT_LT(0, sgm.getStats().recognize_latency.acc_cpu);
+    ASSERT_TRUE(results[0].guess_made);
+    ASSERT_TRUE(results[2].guess_made);
+    EXPECT_EQ("haltbare_milch", results[0].refine_choice.getObject()->name);
+    EXPECT_EQ("haltbare_milch", results[2].refine_choice.getObject()->name);
+}
+
 /** Check whether loading a single training base works without failing */
 TEST_F(test_clutseg, load_single_training_base) {
     SKIP_IF_FAST 
@@ -227,6 +351,85 @@ TEST_F(test_clutseg, recog_in_clutter) {
     recognize("recog_in_clutter");
 }
 
+/** Check whether refining several detect choices concurrently yields the same
+ * choice as refining them one after another. */
+TEST_F(test_clutseg, recog_in_clutter_parallel_refine) {
+    SKIP_IF_FAST 
+
+    TODParameters & detect_params = sgm.getDetectParams();
+    detect_params.guessParams.maxProjectionError = 15.0;
+    detect_params.guessParams.ransacIterationsCount = 100;
+    TODParameters & refine_params = sgm.getRefineParams();
+    refine_params.guessParams.maxProjectionError = 8;
+    refine_params.guessParams.ransacIterationsCount = 500;
+    refine_params.guessParams.minInliersCount = 50;
+
+    ASSERT_TRUE(sgm.isDoRefine());
+    Query query(clutter_img, clutter_cloud);
+    Result sequential;
+    sgm.recognize(query, sequential);
+    ClutsegmenterStats s = sgm.getStats();
+    sgm.resetStats();
+    sgm.setRefineThreads(4);
+    EXPECT_EQ(4, sgm.getRefineThreads());
+    sgm.recognize(query, res);
+    sgm.setRefineThreads(1);
+    ClutsegmenterStats p = sgm.getStats();
+
+    ASSERT_TRUE(sequential.guess_made);
+    ASSERT_TRUE(res.guess_made);
+    EXPECT_EQ(sequential.refine_choice.getObject()->name, res.refine_choice.getObject()->name);
+    EXPECT_EQ(sequential.refine_choice.inliers, res.refine_choice.inliers);
+    EXPECT_EQ(s.choices, p.choices);
+    EXPECT_EQ(s.rejected_choices, p.rejected_choices);
+    EXPECT_EQ(s.acc_detect_choice_matches, p.acc_detect_choice_matches);
+    EXPECT_EQ(s.acc_detect_choice_inliers, p.acc_detect_choice_inliers);
+    EXPECT_EQ(s.acc_refine_matches, p.acc_refine_matches);
+    EXPECT_EQ(s.acc_refine_guesses, p.acc_refine_guesses);
+    EXPECT_EQ(s.acc_refine_inliers, p.acc_refine_inliers);
+    EXPECT_EQ(s.acc_refine_choice_matches, p.acc_refine_choice_matches);
+    EXPECT_EQ(s.acc_refine_choice_inliers, p.acc_refine_choice_inliers);
+    EXPECT_EQ(s.refine_latency.count, p.refine_latency.count);
+}
+
+/** Check whether multi-object mode returns at most one guess per template,
+ * beginning with the same choice as single-object mode. */
+TEST_F(test_clutseg, recog_in_clutter_multi_object) {
+    SKIP_IF_FAST 
+
+    Query query(clutter_img, clutter_cloud);
+    Result single;
+    sgm.recognize(query, single);
+    sgm.setMultiObject(true);
+    sgm.resetStats();
+    sgm.recognize(query, res);
+    sgm.setMultiObject(false);
+    ASSERT_TRUE(single.guess_made);
+    ASSERT_TRUE(res.guess_made);
+    ASSERT_FALSE(res.refine_choices.empty());
+    EXPECT_EQ(single.refine_choice.getObject()->name, res.refine_choice.getObject()->name);
+    EXPECT_EQ(res.refine_choice.getObject()->name, res.refine_choices[0].getObject()->name);
+    set<string> names;
+    BOOST_FOREACH(const Guess & g, res.refine_choices) {
+        EXPECT_TRUE(names.insert(g.getObject()->name).second);
+    }
+    EXPECT_EQ(long(res.refine_choices.size()), sgm.getStats().choices);
+}
+
+/** Check whether the rejection gate keeps all detect choices from being
+ * refined if none of them can pass it. */
+TEST_F(test_clutseg, reject_implausible_choices) {
+    SKIP_IF_FAST 
+
+    sgm.setRejectionGate(INT_MAX, 0, 0);
+    Query query(clutter_img, clutter_cloud);
+    sgm.recognize(query, res);
+    sgm.setRejectionGate(0, 0, 0);
+    EXPECT_FALSE(res.guess_made);
+    EXPECT_EQ(long(res.detect_choices.size()), sgm.getStats().rejected_choices);
+    EXPECT_EQ(0, sgm.getStats().acc_refine_guesses);
+}
+
 /** Check whether an object is at least detected in clutter */
 TEST_F(test_clutseg, recog_in_clutter_detect_only) {
     SKIP_IF_FAST 
@@ -260,6 +463,7 @@ TEST_F(test_clutseg, recog_foremost_in_clutter) {
         refine_params,
         prox_ranking
     );
+    sgm.setCamera(camera);
 
     ASSERT_TRUE(sgm.isDoRefine());
     recognize("recog_foremost_in_clutter");
@@ -286,5 +490,6 @@ TEST_F(test_clutseg, recog_using_tar) {
     SKIP_IF_FAST
 
     sgm = Clutsegmenter("data/orb.tar", true);
+    sgm.setCamera(camera);
     recognize("recog_using_tar");
 }
@@ -0,0 +1,174 @@
+/**
+ * Author: Julius Adorf
+ */
+
+#include "test.h"
+
+#include "clutseg/loader.h"
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <stdexcept>
+
+using namespace clutseg;
+using namespace std;
+
+namespace bfs = boost::filesystem;
+
+TEST(test_loader, missing_image) {
+    vector<string> names;
+    names.push_back("image_00000.png");
+    names.push_back("image_99999.png");
+    SceneLoader loader("./data", names, 1 << 30);
+    string name;
+    Query query;
+    EXPECT_TRUE(loader.next(name, query));
+    EXPECT_THROW(loader.next(name, query), runtime_error);
+    EXPECT_THROW(loader.next(name, query), runtime_error);
+}
+
+TEST(test_loader, destroy_before_taken) {
+    vector<string> names(10, "image_00000.png");
+    SceneLoader loader("./data", names, 1);
+}
+
+/** Test scenes without clouds, unlike ./data, which has a cloud for
+ * image_00000.png. */
+struct test_loader_scenes : public ::testing::Test {
+
+    void SetUp() {
+        dir = "build/test_loader_scenes";
+        bfs::remove_all(dir);
+        bfs::create_directories(dir);
+        bfs::copy_file("./data/image_00000.png", dir / "image_00000.png");
+        bfs::copy_file("./data/image_00042.png", dir / "image_00042.png");
+    }
+
+    void TearDown() {
+        bfs::remove_all(dir);
+    }
+
+    bfs::path dir;
+
+};
+
+TEST_F(test_loader_scenes, in_order) {
+    vector<string> names;
+    names.push_back("image_00000.png");
+    names.push_back("image_00042.png");
+    names.push_back("image_00000.png");
+    SceneLoader loader(dir, names, 1);
+    string name;
+    Query query;
+    for (size_t i = 0; i < names.size(); i++) {
+        ASSERT_TRUE(loader.next(name, query));
+        EXPECT_EQ(names[i], name);
+        EXPECT_FALSE(query.img.empty());
+        EXPECT_EQ(0, query.cloud->points.size());
+    }
+    EXPECT_FALSE(loader.next(name, query));
+}
+
+TEST_F(test_loader_scenes, unreadable_cloud) {
+    ofstream out((dir / "cloud_00042.pcd").string().c_str());
+    out << "garbage" << endl;
+    out.close();
+    vector<string> names;
+    names.push_back("image_00000.png");
+    names.push_back("image_00042.png");
+    SceneLoader loader(dir, names, 1 << 30);
+    string name;
+    Query query;
+    EXPECT_TRUE(loader.next(name, query));
+    EXPECT_THROW(loader.next(name, query), runtime_error);
+}
+
+/** Writes a test set with two scenes to dir. */
+static void writeTestSet(const bfs::path & dir) {
+    bfs::remove_all(dir);
+    bfs::create_directories(dir);
+    bfs::copy_file("./data/camera.yml", dir / "camera.yml");
+    bfs::copy_file("./data/image_00000.png", dir / "image_00000.png");
+    bfs::copy_file("./data/image_00042.png", dir / "image_00042.png");
+    ofstream out((dir / "ground-truth.txt").string().c_str());
+    out << "[images]" << endl;
+    out << "image_00000.png = assam_tea" << endl;
+    out << "image_00042.png = assam_tea" << endl;
+    // loadGroundTruth reads the poses from a file next to each image
+    opencv_candidate::PoseRT pose;
+    samplePose(pose);
+    LabelSet labels;
+    labels.labels.push_back(Label("assam_tea", pose));
+    writeLabelSet(dir / "image_00000.png.ground.yaml", labels);
+    writeLabelSet(dir / "image_00042.png.ground.yaml", labels);
+}
+
+struct test_loader_cache : public ::testing::Test {
+
+    void SetUp() {
+        dir = "build/test_loader";
+        writeTestSet(dir);
+    }
+
+    void TearDown() {
+        bfs::remove_all(dir);
+    }
+
+    bfs::path dir;
+
+};
+
+TEST_F(test_loader_cache, cache_scenes) {
+    TestSetCache cache(1 << 30);
+    boost::shared_ptr<const TestSet> a = cache.get(dir);
+    ASSERT_EQ(2, a->ground_truth.size());
+    EXPECT_TRUE(a->ground_truth.find("image_00000.png")->second.onScene("assam_tea"));
+    cache.waitUntilDecoded();
+    boost::shared_ptr<const TestSet> b = cache.get(dir);
+    ASSERT_EQ(2, b->scenes.size());
+    EXPECT_FALSE(b->scenes.find("image_00042.png")->second.img.empty());
+    boost::shared_ptr<const TestSet> c = cache.get(dir);
+    EXPECT_EQ(b, c);
+}
+
+TEST_F(test_loader_cache, exceed_budget) {
+    TestSetCache cache(1);
+    cache.get(dir);
+    cache.waitUntilDecoded();
+    boost::shared_ptr<const TestSet> a = cache.get(dir);
+    EXPECT_EQ(2, a->ground_truth.size());
+    EXPECT_TRUE(a->scenes.empty());
+}
+
+TEST_F(test_loader_cache, exceed_budget_after_first_scene) {
+    // One decoded scene fits, both of them do not
+    TestSetCache cache(5 << 20);
+    cache.get(dir);
+    cache.waitUntilDecoded();
+    boost::shared_ptr<const TestSet> a = cache.get(dir);
+    EXPECT_TRUE(a->scenes.empty());
+    // The test set is remembered as not fitting, rather than decoded again
+    cache.waitUntilDecoded();
+    boost::shared_ptr<const TestSet> b = cache.get(dir);
+    EXPECT_EQ(a, b);
+}
+
+TEST_F(test_loader_cache, evict_least_recently_used) {
+    bfs::path other = "build/test_loader_other";
+    writeTestSet(other);
+    // Each test set takes about 8 MB, only one of them fits
+    TestSetCache cache(12 << 20);
+    cache.get(dir);
+    cache.waitUntilDecoded();
+    boost::shared_ptr<const TestSet> a = cache.get(dir);
+    ASSERT_EQ(2, a->scenes.size());
+    cache.get(other);
+    cache.waitUntilDecoded();
+    EXPECT_EQ(2, cache.get(other)->scenes.size());
+    // The evicted scenes stay valid for those who still use them
+    EXPECT_TRUE(cache.get(dir)->scenes.empty());
+    EXPECT_EQ(2, a->scenes.size());
+    EXPECT_FALSE(a->scenes.find("image_00000.png")->second.img.empty());
+    bfs::remove_all(other);
+}
@@ -153,3 +153,72 @@ TEST_F(test_map, map_markers) {
     #endif 
 }
 
+
+/** Creates a 4x3 organized cloud with z = index + 1 and a hole at (1, 1). */
+static void holeyCloud(PointCloudT & c) {
+    c.width = 4;
+    c.height = 3;
+    c.points.resize(c.width * c.height);
+    for (size_t i = 0; i < c.points.size(); i++) {
+        c.points[i] = PointXYZ(0, 0, i + 1);
+    }
+    c.points[5] = PointXYZ(NAN, NAN, NAN);
+}
+
+TEST_F(test_map, map_exact) {
+    PointCloudT scene;
+    holeyCloud(scene);
+    Mat scene2d(6, 8, CV_8UC3);
+    vector<Point> kpts;
+    kpts.push_back(Point(0, 0));
+    kpts.push_back(Point(7, 5));
+    kpts.push_back(Point(2, 2));
+    kpts.push_back(Point(8, 0));
+    kpts.push_back(Point(-1, 0));
+    PointCloudT kpts3d;
+    mapToCloud(kpts3d, kpts, scene2d, scene);
+    ASSERT_EQ(5, kpts3d.size());
+    EXPECT_FLOAT_EQ(1, kpts3d.points[0].z);
+    EXPECT_FLOAT_EQ(12, kpts3d.points[1].z);
+    EXPECT_TRUE(isnan(kpts3d.points[2].z));
+    EXPECT_TRUE(isnan(kpts3d.points[3].z));
+    EXPECT_TRUE(isnan(kpts3d.points[4].z));
+}
+
+TEST_F(test_map, map_neighbourhood) {
+    PointCloudT scene;
+    holeyCloud(scene);
+    // Leave only the direct neighbour below the hole, which is closer than
+    // the diagonal ones that come first in the window.
+    scene.points[1] = PointXYZ(NAN, NAN, NAN);
+    scene.points[4] = PointXYZ(NAN, NAN, NAN);
+    scene.points[6] = PointXYZ(NAN, NAN, NAN);
+    Mat scene2d(6, 8, CV_8UC3);
+    vector<Point> kpts;
+    kpts.push_back(Point(2, 2));
+    kpts.push_back(Point(0, 0));
+    PointCloudT kpts3d;
+    mapToCloud(kpts3d, kpts, scene2d, scene, 3);
+    ASSERT_EQ(2, kpts3d.size());
+    EXPECT_FLOAT_EQ(10, kpts3d.points[0].z);
+    // Valid points are not affected
+    EXPECT_FLOAT_EQ(1, kpts3d.points[1].z);
+}
+
+TEST_F(test_map, map_neighbourhood_even) {
+    PointCloudT scene;
+    holeyCloud(scene);
+    scene.points[1] = PointXYZ(NAN, NAN, NAN);
+    scene.points[4] = PointXYZ(NAN, NAN, NAN);
+    scene.points[6] = PointXYZ(NAN, NAN, NAN);
+    scene.points[9] = PointXYZ(NAN, NAN, NAN);
+    Mat scene2d(6, 8, CV_8UC3);
+    vector<Point> kpts;
+    kpts.push_back(Point(2, 2));
+    // Rounded up to a 3x3 window, which only has diagonal neighbours left
+    PointCloudT kpts3d;
+    mapToCloud(kpts3d, kpts, scene2d, scene, 2);
+    ASSERT_EQ(1, kpts3d.size());
+    float z = kpts3d.points[0].z;
+    EXPECT_TRUE(z == 1 || z == 3 || z == 9 || z == 11);
+}
@@ -6,6 +6,7 @@
 #include "clutseg/db.h"
 #include "clutseg/modelbase.h"
 #include "clutseg/paramsel.h"
+#include <boost/algorithm/string/predicate.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
 #include <gtest/gtest.h>
@@ -34,6 +35,9 @@ struct test_paramsel : public ::testing::Test {
         experiment.batch = "some_group";
         experiment.paramset.pms_clutseg.accept_threshold = 15;
         experiment.paramset.pms_clutseg.ranking = "InliersRanking";
+        experiment.paramset.pms_clutseg.min_inliers = 5;
+        experiment.paramset.pms_clutseg.min_depth_ratio = 0.5;
+        experiment.paramset.pms_clutseg.max_extent = 0.4;
         experiment.paramset.train_pms_fe.detector_type = "FAST";
         experiment.paramset.train_pms_fe.extractor_type = "multi-scale";
         experiment.paramset.train_pms_fe.descriptor_type = "rBRIEF";
@@ -98,8 +102,24 @@ struct test_paramsel : public ::testing::Test {
         experiment.response.avg_refine_inliers = 29.8;
         experiment.response.avg_refine_choice_matches = 802.1;
         experiment.response.avg_refine_choice_inliers = 39.8;
+        experiment.response.avg_extract_wall = 0.021;
+        experiment.response.p95_extract_wall = 0.034;
+        experiment.response.avg_extract_cpu = 0.020;
+        experiment.response.avg_detect_wall = 0.152;
+        experiment.response.p95_detect_wall = 0.217;
+        experiment.response.avg_detect_cpu = 0.149;
+        experiment.response.avg_map_wall = 0.004;
+        experiment.response.p95_map_wall = 0.006;
+        experiment.response.avg_map_cpu = 0.004;
+        experiment.response.avg_rank_wall = 0.0001;
+        experiment.response.p95_rank_wall = 0.0002;
+        experiment.response.avg_rank_cpu = 0.0001;
+        experiment.response.avg_refine_wall = 0.061;
+        experiment.response.p95_refine_wall = 0.092;
+        experiment.response.avg_refine_cpu = 0.058;
         experiment.response.train_runtime = 320.5;
         experiment.response.test_runtime = 214.8;
+        experiment.response.test_stage_cpu = 201.3;
         experiment.record_commit();
     }
 
@@ -143,8 +163,24 @@ TEST_F(test_paramsel, init) {
     EXPECT_FLOAT_EQ(0, exp.response.avg_refine_inliers);
     EXPECT_FLOAT_EQ(0, exp.response.avg_refine_choice_matches);
     EXPECT_FLOAT_EQ(0, exp.response.avg_refine_choice_inliers);
+    EXPECT_FLOAT_EQ(0, exp.response.avg_extract_wall);
+    EXPECT_FLOAT_EQ(0, exp.response.p95_extract_wall);
+    EXPECT_FLOAT_EQ(0, exp.response.avg_extract_cpu);
+    EXPECT_FLOAT_EQ(0, exp.response.avg_detect_wall);
+    EXPECT_FLOAT_EQ(0, exp.response.p95_detect_wall);
+    EXPECT_FLOAT_EQ(0, exp.response.avg_detect_cpu);
+    EXPECT_FLOAT_EQ(0, exp.response.avg_map_wall);
+    EXPECT_FLOAT_EQ(0, exp.response.p95_map_wall);
+    EXPECT_FLOAT_EQ(0, exp.response.avg_map_cpu);
+    EXPECT_FLOAT_EQ(0, exp.response.avg_rank_wall);
+    EXPECT_FLOAT_EQ(0, exp.response.p95_rank_wall);
+    EXPECT_FLOAT_EQ(0, exp.response.avg_rank_cpu);
+    EXPECT_FLOAT_EQ(0, exp.response.avg_refine_wall);
+    EXPECT_FLOAT_EQ(0, exp.response.p95_refine_wall);
+    EXPECT_FLOAT_EQ(0, exp.response.avg_refine_cpu);
     EXPECT_FLOAT_EQ(0, exp.response.train_runtime);
     EXPECT_FLOAT_EQ(0, exp.response.test_runtime);
+    EXPECT_FLOAT_EQ(0, exp.response.test_stage_cpu);
 
     Response r;
     EXPECT_FLOAT_EQ(0, r.value);
@@ -173,8 +209,24 @@ TEST_F(test_paramsel, init) {
     EXPECT_FLOAT_EQ(0, r.avg_refine_inliers);
     EXPECT_FLOAT_EQ(0, r.avg_refine_choice_matches);
     EXPECT_FLOAT_EQ(0, r.avg_refine_choice_inliers);
+    EXPECT_FLOAT_EQ(0, r.avg_extract_wall);
+    EXPECT_FLOAT_EQ(0, r.p95_extract_wall);
+    EXPECT_FLOAT_EQ(0, r.avg_extract_cpu);
+    EXPECT_FLOAT_EQ(0, r.avg_detect_wall);
+    EXPECT_FLOAT_EQ(0, r.p95_detect_wall);
+    EXPECT_FLOAT_EQ(0, r.avg_detect_cpu);
+    EXPECT_FLOAT_EQ(0, r.avg_map_wall);
+    EXPECT_FLOAT_EQ(0, r.p95_map_wall);
+    EXPECT_FLOAT_EQ(0, r.avg_map_cpu);
+    EXPECT_FLOAT_EQ(0, r.avg_rank_wall);
+    EXPECT_FLOAT_EQ(0, r.p95_rank_wall);
+    EXPECT_FLOAT_EQ(0, r.avg_rank_cpu);
+    EXPECT_FLOAT_EQ(0, r.avg_refine_wall);
+    EXPECT_FLOAT_EQ(0, r.p95_refine_wall);
+    EXPECT_FLOAT_EQ(0, r.avg_refine_cpu);
     EXPECT_FLOAT_EQ(0, r.train_runtime);
     EXPECT_FLOAT_EQ(0, r.test_runtime);
+    EXPECT_FLOAT_EQ(0, r.test_stage_cpu);
 }
 
 TEST_F(test_paramsel, record_commit) {
@@ -246,8 +298,24 @@ TEST_F(test_paramsel, response_write_read) {
     EXPECT_FLOAT_EQ(orig.avg_refine_inliers, rest.avg_refine_inliers);
     EXPECT_FLOAT_EQ(orig.avg_refine_choice_matches, rest.avg_refine_choice_matches);
     EXPECT_FLOAT_EQ(orig.avg_refine_choice_inliers, rest.avg_refine_choice_inliers);
+    EXPECT_FLOAT_EQ(orig.avg_extract_wall, rest.avg_extract_wall);
+    EXPECT_FLOAT_EQ(orig.p95_extract_wall, rest.p95_extract_wall);
+    EXPECT_FLOAT_EQ(orig.avg_extract_cpu, rest.avg_extract_cpu);
+    EXPECT_FLOAT_EQ(orig.avg_detect_wall, rest.avg_detect_wall);
+    EXPECT_FLOAT_EQ(orig.p95_detect_wall, rest.p95_detect_wall);
+    EXPECT_FLOAT_EQ(orig.avg_detect_cpu, rest.avg_detect_cpu);
+    EXPECT_FLOAT_EQ(orig.avg_map_wall, rest.avg_map_wall);
+    EXPECT_FLOAT_EQ(orig.p95_map_wall, rest.p95_map_wall);
+    EXPECT_FLOAT_EQ(orig.avg_map_cpu, rest.avg_map_cpu);
+    EXPECT_FLOAT_EQ(orig.avg_rank_wall, rest.avg_rank_wall);
+    EXPECT_FLOAT_EQ(orig.p95_rank_wall, rest.p95_rank_wall);
+    EXPECT_FLOAT_EQ(orig.avg_rank_cpu, rest.avg_rank_cpu);
+    EXPECT_FLOAT_EQ(orig.avg_refine_wall, rest.avg_refine_wall);
+    EXPECT_FLOAT_EQ(orig.p95_refine_wall, rest.p95_refine_wall);
+    EXPECT_FLOAT_EQ(orig.avg_refine_cpu, rest.avg_refine_cpu);
     EXPECT_FLOAT_EQ(orig.train_runtime, rest.train_runtime);
     EXPECT_FLOAT_EQ(orig.test_runtime, rest.test_runtime);
+    EXPECT_FLOAT_EQ(orig.test_stage_cpu, rest.test_stage_cpu);
 }
 
 TEST_F(test_paramsel, response_detach) {
@@ -303,6 +371,9 @@ TEST_F(test_paramsel, pms_clutseg_read) {
     p.deserialize(db); 
     EXPECT_FLOAT_EQ(15.0, p.accept_threshold);
     EXPECT_EQ("InliersRanking", p.ranking);
+    EXPECT_EQ(3, p.min_inliers);
+    EXPECT_FLOAT_EQ(0.25, p.min_depth_ratio);
+    EXPECT_FLOAT_EQ(0.0, p.max_extent);
 }
 
 TEST_F(test_paramsel, pms_clutseg_update) {
@@ -311,6 +382,8 @@ TEST_F(test_paramsel, pms_clutseg_update) {
     p.deserialize(db); 
     p.accept_threshold = 30.5;
     p.ranking = "ProximityRanking";
+    p.min_inliers = 7;
+    p.max_extent = 0.5;
     p.serialize(db);
     EXPECT_EQ(1, p.id);
     ClutsegParams p2;
@@ -318,6 +391,8 @@ TEST_F(test_paramsel, pms_clutseg_update) {
     p2.deserialize(db);
     EXPECT_EQ(p.accept_threshold, p2.accept_threshold);
     EXPECT_EQ(p.ranking, p2.ranking);
+    EXPECT_EQ(p.min_inliers, p2.min_inliers);
+    EXPECT_FLOAT_EQ(p.max_extent, p2.max_extent);
     EXPECT_EQ(1, p2.id);
 }
 
@@ -329,6 +404,9 @@ TEST_F(test_paramsel, pms_clutseg_write_read) {
     rest.deserialize(db); 
     EXPECT_FLOAT_EQ(orig.accept_threshold, rest.accept_threshold);
     EXPECT_EQ(orig.ranking, rest.ranking);
+    EXPECT_EQ(orig.min_inliers, rest.min_inliers);
+    EXPECT_FLOAT_EQ(orig.min_depth_ratio, rest.min_depth_ratio);
+    EXPECT_FLOAT_EQ(orig.max_extent, rest.max_extent);
 }
 
 TEST_F(test_paramsel, pms_clutseg_detach) {
@@ -461,6 +539,128 @@ TEST_F(test_paramsel, select_experiments_not_run) {
     EXPECT_TRUE((exps[0].id == e3.id) || exps[0].paramset.pms_clutseg.ranking != "ProximityRanking");
 }
 
+TEST_F(test_paramsel, claim_experiment) {
+    Experiment e = experiment;
+    e.has_run = false;
+    e.name = "e";
+    e.serialize(db);
+    EXPECT_TRUE(claimExperiment(db, e.id, "a", 60));
+    EXPECT_TRUE(holdsClaim(db, e.id, "a"));
+    EXPECT_FALSE(claimExperiment(db, e.id, "b", 60));
+    EXPECT_FALSE(holdsClaim(db, e.id, "b"));
+    EXPECT_TRUE(claimExperiment(db, e.id, "a", 60));
+    vector<Experiment> exps;
+    selectExperimentsNotRun(db, exps);
+    for (size_t i = 0; i < exps.size(); i++) {
+        EXPECT_NE(e.id, exps[i].id);
+    }
+    releaseClaims(db, "a");
+    EXPECT_FALSE(holdsClaim(db, e.id, "a"));
+    EXPECT_TRUE(claimExperiment(db, e.id, "b", 60));
+}
+
+TEST_F(test_paramsel, claim_expired_lease) {
+    Experiment e = experiment;
+    e.has_run = false;
+    e.name = "e";
+    e.serialize(db);
+    EXPECT_TRUE(claimExperiment(db, e.id, "a", -1));
+    EXPECT_TRUE(claimExperiment(db, e.id, "b", 60));
+    EXPECT_FALSE(holdsClaim(db, e.id, "a"));
+    renewClaims(db, "a", 60);
+    EXPECT_TRUE(holdsClaim(db, e.id, "b"));
+}
+
+TEST_F(test_paramsel, claim_experiment_quoted_runner) {
+    Experiment e = experiment;
+    e.has_run = false;
+    e.name = "e";
+    e.serialize(db);
+    string runner = "host' or '1'='1:42";
+    EXPECT_TRUE(claimExperiment(db, e.id, runner, 60));
+    EXPECT_TRUE(holdsClaim(db, e.id, runner));
+    EXPECT_FALSE(holdsClaim(db, e.id, "host"));
+    renewClaims(db, runner, 60);
+    EXPECT_TRUE(holdsClaim(db, e.id, runner));
+    releaseClaims(db, runner);
+    EXPECT_FALSE(holdsClaim(db, e.id, runner));
+}
+
+TEST_F(test_paramsel, claim_experiment_run) {
+    Experiment e = experiment;
+    e.has_run = true;
+    e.name = "e";
+    e.serialize(db);
+    EXPECT_FALSE(claimExperiment(db, e.id, "a", 60));
+}
+
+TEST_F(test_paramsel, count_experiments_to_run) {
+    int n = countExperimentsToRun(db);
+    Experiment e = experiment;
+    e.has_run = false;
+    e.name = "e";
+    e.serialize(db);
+    EXPECT_EQ(n + 1, countExperimentsToRun(db));
+    EXPECT_TRUE(claimExperiment(db, e.id, "a", 60));
+    EXPECT_EQ(n, countExperimentsToRun(db));
+    releaseClaims(db, "a");
+    e.skip = true;
+    e.serialize(db);
+    EXPECT_EQ(n, countExperimentsToRun(db));
+}
+
+TEST_F(test_paramsel, notify_experiments_enqueued) {
+    string marker = enqueuedMarkerPath(db);
+    EXPECT_TRUE(boost::algorithm::ends_with(marker, "/test_paramsel.sqlite3.enqueued"));
+    boost::filesystem::remove(marker);
+    notifyExperimentsEnqueued(db);
+    EXPECT_TRUE(boost::filesystem::exists(marker));
+}
+
+TEST_F(test_paramsel, upgrade_schema_current) {
+    upgradeSchema(db);
+    Response r = experiment.response;
+    r.serialize(db);
+    Response s;
+    s.id = r.id;
+    s.deserialize(db);
+    EXPECT_EQ(r.avg_refine_cpu, s.avg_refine_cpu);
+}
+
+TEST_F(test_paramsel, upgrade_schema) {
+    string fn = "build/test_paramsel_upgrade.sqlite3";
+    boost::filesystem::remove(fn);
+    sqlite3* old;
+    db_open(old, fn);
+    EXPECT_THROW(upgradeSchema(old), ios_base::failure);
+    db_exec(old, "create table response (id integer primary key autoincrement, value float not null);");
+    db_exec(old, "insert into response (value) values (1.0);");
+    db_exec(old, "create table pms_clutseg (id integer primary key autoincrement, accept_threshold float, ranking varchar(255));");
+    db_exec(old, "insert into pms_clutseg (accept_threshold, ranking) values (10, 'InliersRanking');");
+    db_exec(old, "create table experiment (id integer primary key autoincrement, name varchar(255) unique not null);");
+    db_exec(old, "insert into experiment (name) values ('e');");
+    upgradeSchema(old);
+    sqlite3_stmt *read;
+    db_prepare(old, read, "select avg_extract_wall, p95_refine_wall, test_stage_cpu from response;");
+    db_step(read, SQLITE_ROW);
+    EXPECT_EQ(0, sqlite3_column_double(read, 0));
+    EXPECT_EQ(0, sqlite3_column_double(read, 1));
+    EXPECT_EQ(0, sqlite3_column_double(read, 2));
+    sqlite3_finalize(read);
+    db_prepare(old, read, "select min_inliers, min_depth_ratio, max_extent from pms_clutseg;");
+    db_step(read, SQLITE_ROW);
+    EXPECT_EQ(0, sqlite3_column_int(read, 0));
+    EXPECT_EQ(0, sqlite3_column_double(read, 1));
+    EXPECT_EQ(0, sqlite3_column_double(read, 2));
+    sqlite3_finalize(read);
+    db_prepare(old, read, "select claimed_by, lease_expires from experiment;");
+    db_step(read, SQLITE_ROW);
+    EXPECT_EQ(SQLITE_NULL, sqlite3_column_type(read, 0));
+    EXPECT_EQ(SQLITE_NULL, sqlite3_column_type(read, 1));
+    sqlite3_finalize(read);
+    db_close(old);
+}
+
 TEST_F(test_paramsel, sort_experiments_by_train_features) {
     Experiment e1 = experiment;
     Experiment e2 = experiment;
@@ -490,3 +690,24 @@ TEST_F(test_paramsel, to_detect_tod_parameters) {
     EXPECT_EQ(dp.guessParams.minInliersCount, 10);
     EXPECT_EQ(experiment.paramset.detect_pms_guess.minInliersCount, 15);
 }
+
+TEST_F(test_paramsel, equal_pms_fe) {
+    FeatureExtractionParams a;
+    int64_t id = 1;
+    deserialize_pms_fe(db, a, id); 
+    FeatureExtractionParams b = a;
+    EXPECT_TRUE(equal_pms_fe(a, b));
+    b.detector_params["threshold"] = 30;
+    EXPECT_FALSE(equal_pms_fe(a, b));
+    b = a;
+    b.descriptor_type = "ORB";
+    EXPECT_FALSE(equal_pms_fe(a, b));
+}
+
+TEST_F(test_paramsel, equal_pms_match) {
+    MatcherParameters a = experiment.paramset.detect_pms_match;
+    MatcherParameters b = a;
+    EXPECT_TRUE(equal_pms_match(a, b));
+    b.knn++;
+    EXPECT_FALSE(equal_pms_match(a, b));
+}
@@ -0,0 +1,142 @@
+/**
+ * Author: Julius Adorf
+ */
+
+#include "clutseg/pool.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <gtest/gtest.h>
+#include <stdexcept>
+
+using namespace cv;
+using namespace clutseg;
+
+struct test_pool : public ::testing::Test {
+
+    static Ptr<int> create(int * created) {
+        return new int((*created)++);
+    }
+
+    void SetUp() {
+        created = 0;
+        pool = new Pool<int>(boost::bind(create, &created));
+    }
+
+    int created;
+    Ptr<Pool<int> > pool;
+
+};
+
+TEST_F(test_pool, reuse_released) {
+    Ptr<int> a = pool->acquire();
+    pool->release(a);
+    Ptr<int> b = pool->acquire();
+    EXPECT_EQ(1, created);
+    EXPECT_EQ(0, *b);
+}
+
+TEST_F(test_pool, create_if_all_in_use) {
+    Ptr<int> a = pool->acquire();
+    Ptr<int> b = pool->acquire();
+    EXPECT_EQ(2, created);
+    EXPECT_NE(*a, *b);
+}
+
+TEST_F(test_pool, lease) {
+    {
+        Pool<int>::Lease l(*pool);
+        EXPECT_EQ(0, **l);
+    }
+    {
+        Pool<int>::Lease l(*pool);
+        EXPECT_EQ(0, **l);
+    }
+    EXPECT_EQ(1, created);
+}
+
+static void acquireAndRelease(Pool<int> * pool, int * value) {
+    Pool<int>::Lease l(*pool);
+    *value = **l;
+}
+
+TEST_F(test_pool, wait_if_at_capacity) {
+    Pool<int> bounded(boost::bind(create, &created), 1);
+    Ptr<int> a = bounded.acquire();
+    int value = -1;
+    boost::thread t(boost::bind(acquireAndRelease, &bounded, &value));
+    EXPECT_FALSE(t.timed_join(boost::posix_time::milliseconds(100)));
+    bounded.release(a);
+    t.join();
+    EXPECT_EQ(0, value);
+    EXPECT_EQ(1, created);
+}
+
+TEST_F(test_pool, grow_capacity) {
+    Pool<int> bounded(boost::bind(create, &created), 1);
+    Ptr<int> a = bounded.acquire();
+    int value = -1;
+    boost::thread t(boost::bind(acquireAndRelease, &bounded, &value));
+    EXPECT_FALSE(t.timed_join(boost::posix_time::milliseconds(100)));
+    bounded.setCapacity(2);
+    t.join();
+    EXPECT_EQ(1, value);
+    EXPECT_EQ(2, created);
+}
+
+TEST_F(test_pool, shrink_capacity) {
+    Ptr<int> a = pool->acquire();
+    Ptr<int> b = pool->acquire();
+    Ptr<int> c = pool->acquire();
+    pool->release(a);
+    // Drops the idle object, and the first one released afterwards
+    pool->setCapacity(1);
+    EXPECT_EQ(1, pool->getCapacity());
+    pool->release(b);
+    pool->release(c);
+    Ptr<int> d = pool->acquire();
+    EXPECT_EQ(2, *d);
+    EXPECT_EQ(3, created);
+}
+
+static void increment(boost::mutex * mutex, boost::condition_variable * cond, int * count) {
+    boost::mutex::scoped_lock lock(*mutex);
+    (*count)++;
+    cond->notify_all();
+}
+
+static void fail() {
+    throw std::runtime_error("fail");
+}
+
+TEST(test_thread_pool, run_tasks) {
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    int count = 0;
+    ThreadPool pool(2);
+    EXPECT_EQ(2, pool.getThreads());
+    // A failing task does not take down its thread
+    pool.submit(fail);
+    pool.submit(fail);
+    for (int i = 0; i < 10; i++) {
+        pool.submit(boost::bind(increment, &mutex, &cond, &count));
+    }
+    boost::mutex::scoped_lock lock(mutex);
+    while (count < 10) {
+        cond.wait(lock);
+    }
+    EXPECT_EQ(10, count);
+}
+
+TEST(test_thread_pool, destroy_with_pending_tasks) {
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    int count = 0;
+    {
+        ThreadPool pool(1);
+        for (int i = 0; i < 1000; i++) {
+            pool.submit(boost::bind(increment, &mutex, &cond, &count));
+        }
+    }
+    EXPECT_GE(1000, count);
+}
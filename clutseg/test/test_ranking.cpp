@@ -4,6 +4,7 @@
 
 #include "test.h"
 
+#include "clutseg/pose.h"
 #include "clutseg/ranking.h"
 
 #include <cv.h>
@@ -53,6 +54,21 @@ TEST_F(test_ranking, proximity_ranking) {
     EXPECT_GT(proximity_ranking(close_guess), proximity_ranking(far_guess));
 }
 
+TEST_F(test_ranking, needs_inlier_cloud) {
+    EXPECT_FALSE(uniform_ranking.needsInlierCloud());
+    EXPECT_FALSE(inliers_ranking.needsInlierCloud());
+    EXPECT_TRUE(proximity_ranking.needsInlierCloud());
+    EXPECT_FALSE(ProductRanking(new InliersRanking(), new UniformRanking()).needsInlierCloud());
+    EXPECT_TRUE(ProductRanking(new InliersRanking(), new ProximityRanking()).needsInlierCloud());
+}
+
+TEST_F(test_ranking, create_ranking) {
+    EXPECT_FALSE(createRanking("InliersRanking")->needsInlierCloud());
+    EXPECT_TRUE(createRanking("ProximityRanking")->needsInlierCloud());
+    EXPECT_FLOAT_EQ(1.0, (*createRanking("UniformRanking"))(many_inliers_guess));
+    EXPECT_THROW(createRanking("NoSuchRanking"), runtime_error);
+}
+
 TEST_F(test_ranking, uniform_sort) {
     // I expect this to be a no-op
     Ptr<GuessRanking> r = new UniformRanking();
@@ -76,3 +92,104 @@ TEST_F(test_ranking, inliers_sort) {
     GuessComparator cmp(r);
     max(guesses.begin(), guesses.end(), cmp);
 }*/
+
+TEST_F(test_ranking, proximity_ignores_nan) {
+    Guess g = close_guess;
+    g.inlierCloud.push_back(pcl::PointXYZ(NAN, NAN, NAN));
+    EXPECT_FLOAT_EQ(proximity_ranking(close_guess), proximity_ranking(g));
+    Guess no_depth;
+    no_depth.inlierCloud.push_back(pcl::PointXYZ(NAN, NAN, NAN));
+    EXPECT_FLOAT_EQ(0, proximity_ranking(no_depth));
+}
+
+TEST_F(test_ranking, score_all) {
+    vector<float> scores;
+    ProductRanking r(new InliersRanking(), new UniformRanking());
+    r.scoreAll(guesses, scores);
+    ASSERT_EQ(2, scores.size());
+    EXPECT_FLOAT_EQ(9, scores[0]);
+    EXPECT_FLOAT_EQ(150, scores[1]);
+}
+
+TEST_F(test_ranking, sort_guesses) {
+    sortGuesses(guesses, inliers_ranking);
+    EXPECT_EQ(150, guesses[0].inliers.size());
+    EXPECT_EQ(9, guesses[1].inliers.size());
+    // stable for equal scores
+    sortGuesses(guesses, uniform_ranking);
+    EXPECT_EQ(150, guesses[0].inliers.size());
+}
+
+TEST_F(test_ranking, select_guesses) {
+    guesses.push_back(close_guess);
+    selectGuesses(guesses, inliers_ranking, 2);
+    ASSERT_EQ(2, guesses.size());
+    EXPECT_EQ(150, guesses[0].inliers.size());
+    EXPECT_EQ(9, guesses[1].inliers.size());
+}
+
+TEST_F(test_ranking, best_guess) {
+    EXPECT_EQ(1, bestGuess(guesses, inliers_ranking));
+    EXPECT_EQ(0, bestGuess(guesses, uniform_ranking));
+}
+
+TEST_F(test_ranking, linear_ranking) {
+    vector<float> w(LinearRanking::FEATURES + 1, 0);
+    w[0] = 1;
+    w[LinearRanking::INLIERS + 1] = 2;
+    LinearRanking r(w);
+    EXPECT_FLOAT_EQ(19, r(few_inliers_guess));
+    EXPECT_FLOAT_EQ(301, r(many_inliers_guess));
+    EXPECT_FALSE(r.needsInlierCloud());
+    w[LinearRanking::PROXIMITY + 1] = 1;
+    EXPECT_TRUE(LinearRanking(w).needsInlierCloud());
+    EXPECT_THROW(LinearRanking(vector<float>(2, 0)), runtime_error);
+}
+
+TEST_F(test_ranking, linear_ranking_features) {
+    float f[LinearRanking::FEATURES];
+    close_guess.image_points_.resize(4);
+    LinearRanking::features(close_guess, close_guess.inlierCloud, opencv_candidate::Camera(), f);
+    EXPECT_FLOAT_EQ(1, f[LinearRanking::INLIERS]);
+    EXPECT_FLOAT_EQ(4, f[LinearRanking::MATCHES]);
+    EXPECT_FLOAT_EQ(0.25, f[LinearRanking::INLIER_RATIO]);
+    EXPECT_FLOAT_EQ(proximity_ranking(close_guess), f[LinearRanking::PROXIMITY]);
+}
+
+TEST_F(test_ranking, linear_ranking_reprojection_error) {
+    float f[LinearRanking::FEATURES];
+    // One meter in front of the camera, 100 pixels per meter
+    opencv_candidate::PoseRT pose;
+    pose.rvec = Mat::zeros(3, 1, CV_64F);
+    pose.tvec = (Mat_<double>(3, 1) << 0, 0, 1);
+    opencv_candidate::Camera camera;
+    camera.K = (Mat_<double>(3, 3) << 100, 0, 0, 0, 100, 0, 0, 0, 1);
+    camera.D = Mat::zeros(5, 1, CV_64F);
+    Guess g(new TexturedObject(), poseRtToPose(pose), Mat(), Mat(), Mat());
+    g.aligned_points_.push_back(Point3f(0, 0, 0));
+    g.aligned_points_.push_back(Point3f(0.1, 0.1, 0));
+    g.aligned_points_.push_back(Point3f(0.2, 0.2, 0));
+    g.image_points_.push_back(Point2f(3, 4));
+    g.image_points_.push_back(Point2f(0, 0));
+    g.image_points_.push_back(Point2f(20, 21));
+    g.inliers.push_back(0);
+    g.inliers.push_back(2);
+    LinearRanking::features(g, g.inlierCloud, camera, f);
+    EXPECT_NEAR(3, f[LinearRanking::REPROJECTION_ERROR], 1e-4);
+    // The ranking uses the camera it has been given
+    vector<float> w(LinearRanking::FEATURES + 1, 0);
+    w[LinearRanking::REPROJECTION_ERROR + 1] = 1;
+    EXPECT_NEAR(3, LinearRanking(w, camera)(g), 1e-4);
+    // Without a camera, the error is unknown rather than garbage
+    LinearRanking::features(g, g.inlierCloud, opencv_candidate::Camera(), f);
+    EXPECT_FLOAT_EQ(0, f[LinearRanking::REPROJECTION_ERROR]);
+    LinearRanking::features(few_inliers_guess, few_inliers_guess.inlierCloud, camera, f);
+    EXPECT_FLOAT_EQ(0, f[LinearRanking::REPROJECTION_ERROR]);
+}
+
+TEST_F(test_ranking, create_linear_ranking) {
+    Ptr<GuessRanking> r = createRanking("LinearRanking 1 2 0 0 0 0");
+    EXPECT_FLOAT_EQ(19, (*r)(few_inliers_guess));
+    EXPECT_THROW(createRanking("LinearRanking 1 2"), runtime_error);
+    EXPECT_THROW(createRanking("LinearRanking 1 x 0 0 0 0"), runtime_error);
+}
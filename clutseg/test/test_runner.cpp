@@ -39,6 +39,22 @@ TEST_F(test_runner, cloud_name) {
     }
 }
 
+TEST_F(test_runner, workers) {
+    EXPECT_EQ(1, runner.getWorkers());
+    runner.setWorkers(4);
+    EXPECT_EQ(4, runner.getWorkers());
+    runner.setWorkers(0);
+    EXPECT_EQ(1, runner.getWorkers());
+}
+
+TEST_F(test_runner, threads) {
+    EXPECT_LE(1, runner.getThreads());
+    runner.setThreads(3);
+    EXPECT_EQ(3, runner.getThreads());
+    runner.setThreads(-1);
+    EXPECT_EQ(1, runner.getThreads());
+}
+
 TEST_F(test_runner, print_num_procs_online) {
     cout << sysconf(_SC_NPROCESSORS_ONLN) << endl;
 }
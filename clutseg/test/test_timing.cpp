@@ -0,0 +1,63 @@
+/**
+ * Author: Julius Adorf
+ */
+
+#include "clutseg/timing.h"
+
+#include <gtest/gtest.h>
+
+using namespace clutseg;
+
+TEST(test_timing, stopwatch) {
+    Stopwatch watch;
+    volatile double x = 0;
+    for (int i = 0; i < 1000000; i++) {
+        x += i;
+    }
+    EXPECT_LT(0, watch.wall());
+    EXPECT_LT(0, watch.cpu());
+}
+
+TEST(test_timing, latency_empty) {
+    LatencyStats s;
+    EXPECT_EQ(0, s.count);
+    EXPECT_DOUBLE_EQ(0, s.avgWall());
+    EXPECT_DOUBLE_EQ(0, s.avgCpu());
+    EXPECT_DOUBLE_EQ(0, s.wallPercentile(0.95));
+}
+
+TEST(test_timing, latency_averages) {
+    LatencyStats s;
+    s.add(0.1, 0.05);
+    s.add(0.3, 0.15);
+    EXPECT_EQ(2, s.count);
+    EXPECT_DOUBLE_EQ(0.2, s.avgWall());
+    EXPECT_DOUBLE_EQ(0.1, s.avgCpu());
+}
+
+TEST(test_timing, latency_percentile) {
+    LatencyStats s;
+    for (int i = 0; i < 90; i++) {
+        s.add(0.01, 0);
+    }
+    for (int i = 0; i < 10; i++) {
+        s.add(1.0, 0);
+    }
+    // Upper bounds of the bins are at most 19% off
+    EXPECT_LE(0.01, s.wallPercentile(0.5));
+    EXPECT_GT(0.012, s.wallPercentile(0.5));
+    EXPECT_LE(1.0, s.wallPercentile(0.95));
+    EXPECT_GT(1.2, s.wallPercentile(0.95));
+}
+
+TEST(test_timing, latency_add_up) {
+    LatencyStats a;
+    LatencyStats b;
+    a.add(0.01, 0.01);
+    b.add(1.0, 0.5);
+    a += b;
+    EXPECT_EQ(2, a.count);
+    EXPECT_DOUBLE_EQ(1.01, a.acc_wall);
+    EXPECT_DOUBLE_EQ(0.51, a.acc_cpu);
+    EXPECT_LE(1.0, a.wallPercentile(1.0));
+}
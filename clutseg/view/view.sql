@@ -1,6 +1,7 @@
 drop view if exists view_experiment_response;
 drop view if exists view_experiment_note;
 drop view if exists view_experiment_runtime;
+drop view if exists view_experiment_latency;
 drop view if exists view_experiment_error;
 drop view if exists view_experiment_detect_roc;
 drop view if exists view_experiment_scores;
@@ -25,7 +26,28 @@ create view view_experiment_note as
 create view view_experiment_runtime as
     select experiment_id,
         train_runtime,
-        test_runtime
+        test_runtime,
+        test_stage_cpu
+    from view_experiment_response;
+
+create view view_experiment_latency as
+    select experiment_id,
+        experiment_name,
+        avg_extract_wall,
+        p95_extract_wall,
+        avg_extract_cpu,
+        avg_detect_wall,
+        p95_detect_wall,
+        avg_detect_cpu,
+        avg_map_wall,
+        p95_map_wall,
+        avg_map_cpu,
+        avg_rank_wall,
+        p95_rank_wall,
+        avg_rank_cpu,
+        avg_refine_wall,
+        p95_refine_wall,
+        avg_refine_cpu
     from view_experiment_response;
 
 create view view_experiment_error as